@@ -0,0 +1,44 @@
+#!/bin/bash
+# Measures compression throughput over the repo's tilesets and Pokémon pics,
+# converted to 4bpp the same way the build does.
+# Usage: bench.sh [GBAGFX...]   (default: tools/gbagfx/gbagfx)
+# Pass several binaries to compare them on the same inputs.
+# COMPRESSION picks lz (the default), rl or huff. Extra compression options can
+# be given in FLAGS (or LZFLAGS).
+
+set -e
+
+GBAGFXS=()
+for gbagfx in "$@"; do
+    GBAGFXS+=("$(cd "$(dirname "$gbagfx")" && pwd)/$(basename "$gbagfx")")
+done
+
+cd "$(dirname "$0")/../.."
+
+ITERATIONS=${ITERATIONS:-1}
+COMPRESSION=${COMPRESSION:-lz}
+FLAGS=${FLAGS:-$LZFLAGS}
+[ ${#GBAGFXS[@]} -eq 0 ] && GBAGFXS=(tools/gbagfx/gbagfx)
+
+WORKDIR=$(mktemp -d)
+trap 'rm -rf "$WORKDIR"' EXIT
+
+i=0
+for png in data/tilesets/*/*/tiles.png graphics/pokemon/*/front.png graphics/pokemon/*/back.png; do
+    i=$((i + 1))
+    "${GBAGFXS[0]}" "$png" "$WORKDIR/$i.4bpp"
+done
+bytes=$(cat "$WORKDIR"/*.4bpp | wc -c)
+
+for gbagfx in "${GBAGFXS[@]}"; do
+    start=$(date +%s%N)
+    for ((iter = 0; iter < ITERATIONS; iter++)); do
+        for input in "$WORKDIR"/*.4bpp; do
+            "$gbagfx" "$input" "$input.$COMPRESSION" $FLAGS
+        done
+    done
+    end=$(date +%s%N)
+    ns=$(( (end - start) / ITERATIONS ))
+    compressed=$(cat "$WORKDIR"/*."$COMPRESSION" | wc -c)
+    echo "$gbagfx: $bytes bytes -> $compressed in $((ns / 1000)) us per pass ($((bytes * 1000000 / ns)) KB/s)"
+done
@@ -0,0 +1,296 @@
+// Copyright (c) 2015 YamaArashi
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+#include "global.h"
+#include "util.h"
+#include "cache.h"
+
+// The Makefile sets this to a checksum of the sources, so any change to the
+// tool invalidates everything it cached before.
+#ifndef GBAGFX_VERSION
+#define GBAGFX_VERSION __DATE__ " " __TIME__
+#endif
+
+// Options whose argument is the path of an extra input file. The key uses
+// the file's contents rather than its path.
+static const char *const sInputFileOptions[] = { "-palette", "-tilemap", NULL };
+
+static pthread_mutex_t sTempFileMutex = PTHREAD_MUTEX_INITIALIZER;
+static int sTempFileCount;
+
+// The cache is off unless GBAGFX_CACHE_DIR names a directory. It can be shared
+// by any number of checkouts and concurrent gbagfx processes.
+char *GetCacheDir(void)
+{
+    char *cacheDir = getenv("GBAGFX_CACHE_DIR");
+
+    if (cacheDir == NULL || *cacheDir == 0)
+        return NULL;
+
+    return cacheDir;
+}
+
+// -intermediate, and -tilemap when converting from PNG, write a second file,
+// which a cache hit wouldn't produce. Verification needs the uncompressed
+// data, which a cache hit doesn't have, so it always runs the conversion.
+bool IsCacheable(int argc, char **argv)
+{
+    char *inputFileExtension = GetFileExtensionAfterDot(argv[1]);
+    bool fromPng = inputFileExtension != NULL && strcmp(inputFileExtension, "png") == 0;
+
+    if (IsVerifyEnvSet())
+        return false;
+
+    for (int i = 3; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-intermediate") == 0 || strcmp(argv[i], "-verify") == 0
+            || (fromPng && strcmp(argv[i], "-tilemap") == 0))
+            return false;
+    }
+
+    return true;
+}
+
+static uint64_t HashBytes(uint64_t hash, const void *data, size_t size)
+{
+    const unsigned char *bytes = data;
+
+    // FNV-1a
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+// Each field is prefixed with its length so that adjacent fields can't run
+// together into the same key.
+static uint64_t HashField(uint64_t hash, const void *data, size_t size)
+{
+    uint64_t length = size;
+
+    hash = HashBytes(hash, &length, sizeof(length));
+    return HashBytes(hash, data, size);
+}
+
+static uint64_t HashString(uint64_t hash, const char *s)
+{
+    return HashField(hash, s, strlen(s));
+}
+
+static uint64_t HashFileContents(uint64_t hash, char *path)
+{
+    int size;
+    unsigned char *buffer = ReadWholeFile(path, &size);
+
+    hash = HashField(hash, buffer, size);
+    free(buffer);
+    return hash;
+}
+
+// Returns everything after the first '.' in the file name, e.g. "4bpp.lz"
+// for "graphics/foo.4bpp.lz".
+static char *GetFullExtension(char *path)
+{
+    char *name = path;
+
+    for (char *s = path; *s != 0; s++)
+    {
+        if (*s == '/' || *s == '\\')
+            name = s + 1;
+    }
+
+    char *extension = strchr(name, '.');
+
+    return extension != NULL ? extension + 1 : "";
+}
+
+static bool IsInputFileOption(char *option)
+{
+    for (int i = 0; sInputFileOptions[i] != NULL; i++)
+    {
+        if (strcmp(option, sInputFileOptions[i]) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+// The key covers the tool version, the conversion (input and output file
+// types), the options and the contents of every input file. Paths are left out
+// so that the same graphics in different checkouts share entries.
+uint64_t GetCacheKey(char *inputPath, char *outputPath, int argc, char **argv)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+
+    hash = HashString(hash, "gbagfx " GBAGFX_VERSION);
+    hash = HashString(hash, GetFileExtension(inputPath));
+    hash = HashString(hash, GetFullExtension(outputPath));
+    hash = HashFileContents(hash, inputPath);
+
+    for (int i = 3; i < argc; i++)
+    {
+        hash = HashString(hash, argv[i]);
+
+        if (IsInputFileOption(argv[i]) && i + 1 < argc)
+        {
+            i++;
+            hash = HashFileContents(hash, argv[i]);
+        }
+    }
+
+    return hash;
+}
+
+static char *GetCachePath(char *cacheDir, uint64_t key, const char *suffix)
+{
+    size_t size = strlen(cacheDir) + strlen(suffix) + 18;
+    char *path = malloc(size);
+
+    if (path == NULL)
+        FATAL_ERROR("Failed to allocate memory for cache path.\n");
+
+    snprintf(path, size, "%s/%016" PRIx64 "%s", cacheDir, key, suffix);
+    return path;
+}
+
+// Unlike ReadWholeFile, a missing file isn't an error here.
+static unsigned char *ReadCacheFile(char *path, long *size)
+{
+    FILE *fp = fopen(path, "rb");
+
+    if (fp == NULL)
+        return NULL;
+
+    fseek(fp, 0, SEEK_END);
+
+    *size = ftell(fp);
+
+    unsigned char *buffer = malloc(*size + 1);
+
+    if (buffer == NULL)
+        FATAL_ERROR("Failed to allocate memory for reading \"%s\".\n", path);
+
+    rewind(fp);
+
+    if (*size != 0 && fread(buffer, *size, 1, fp) != 1)
+        FATAL_ERROR("Failed to read \"%s\".\n", path);
+
+    fclose(fp);
+
+    return buffer;
+}
+
+// An entry is the size of the warnings the conversion printed as 4 bytes,
+// little-endian, then the warnings, then the output file's contents.
+bool RestoreFromCache(char *cacheDir, uint64_t key, char *outputPath)
+{
+    char *cachePath = GetCachePath(cacheDir, key, "");
+    long size;
+    unsigned char *buffer = ReadCacheFile(cachePath, &size);
+
+    free(cachePath);
+
+    if (buffer == NULL)
+        return false;
+
+    long warningsSize = size < 4 ? -1 : buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | ((long)buffer[3] << 24);
+
+    // Treat a malformed entry as a miss; storing the conversion replaces it.
+    if (warningsSize < 0 || warningsSize > size - 4)
+    {
+        free(buffer);
+        return false;
+    }
+
+    long outputSize = size - 4 - warningsSize;
+    FILE *fp = fopen(outputPath, "wb");
+
+    if (fp == NULL)
+        FATAL_ERROR("Failed to open \"%s\" for writing.\n", outputPath);
+
+    if (outputSize != 0 && fwrite(buffer + 4 + warningsSize, outputSize, 1, fp) != 1)
+        FATAL_ERROR("Failed to write to \"%s\".\n", outputPath);
+
+    fclose(fp);
+
+    // Repeat the warnings, so that a cached build says the same as a clean one.
+    if (warningsSize != 0)
+        fwrite(buffer + 4, warningsSize, 1, stderr);
+
+    free(buffer);
+
+    return true;
+}
+
+// Entries are written to a temporary file that's unique to this process and
+// thread, then renamed into place, so readers only ever see complete entries.
+// Storing is best-effort: if the cache can't be written, the conversion still
+// succeeds.
+void StoreInCache(char *cacheDir, uint64_t key, char *outputPath, char *warnings, size_t warningsSize)
+{
+    long size;
+    unsigned char *buffer = ReadCacheFile(outputPath, &size);
+
+    if (buffer == NULL)
+        return;
+
+#ifdef _WIN32
+    _mkdir(cacheDir);
+#else
+    mkdir(cacheDir, 0777);
+#endif
+
+    pthread_mutex_lock(&sTempFileMutex);
+    int tempFileNum = sTempFileCount++;
+    pthread_mutex_unlock(&sTempFileMutex);
+
+    char suffix[32];
+
+    snprintf(suffix, sizeof(suffix), ".%d.%d.tmp", (int)getpid(), tempFileNum);
+
+    char *tempPath = GetCachePath(cacheDir, key, suffix);
+    char *cachePath = GetCachePath(cacheDir, key, "");
+    FILE *fp = fopen(tempPath, "wb");
+
+    if (fp != NULL)
+    {
+        unsigned char header[4] = {
+            (unsigned char)warningsSize,
+            (unsigned char)(warningsSize >> 8),
+            (unsigned char)(warningsSize >> 16),
+            (unsigned char)(warningsSize >> 24),
+        };
+        bool written = fwrite(header, sizeof(header), 1, fp) == 1
+                    && (warningsSize == 0 || fwrite(warnings, warningsSize, 1, fp) == 1)
+                    && (size == 0 || fwrite(buffer, size, 1, fp) == 1);
+
+        if (fclose(fp) != 0)
+            written = false;
+
+        // If another process stored the same entry first, rename fails on
+        // Windows. The entry it stored is identical, so that's fine.
+        if (!written || rename(tempPath, cachePath) != 0)
+            remove(tempPath);
+    }
+
+    free(tempPath);
+    free(cachePath);
+    free(buffer);
+}
@@ -0,0 +1,16 @@
+// Copyright (c) 2015 YamaArashi
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+char *GetCacheDir(void);
+bool IsCacheable(int argc, char **argv);
+uint64_t GetCacheKey(char *inputPath, char *outputPath, int argc, char **argv);
+bool RestoreFromCache(char *cacheDir, uint64_t key, char *outputPath);
+void StoreInCache(char *cacheDir, uint64_t key, char *outputPath, char *warnings, size_t warningsSize);
+
+#endif // CACHE_H
@@ -19,6 +19,15 @@
 
 #define DOWNCONVERT_BIT_DEPTH(x) ((x) / 8)
 
+#define REVERSE_BITS_2(n) (n), (n) + 0x80, (n) + 0x40, (n) + 0xC0
+#define REVERSE_BITS_4(n) REVERSE_BITS_2(n), REVERSE_BITS_2((n) + 0x20), REVERSE_BITS_2((n) + 0x10), REVERSE_BITS_2((n) + 0x30)
+#define REVERSE_BITS_6(n) REVERSE_BITS_4(n), REVERSE_BITS_4((n) + 0x08), REVERSE_BITS_4((n) + 0x04), REVERSE_BITS_4((n) + 0x0C)
+
+// 1bpp tiles store the leftmost pixel in the lowest bit, images in the highest.
+static const unsigned char sReversedBits[256] = {
+	REVERSE_BITS_6(0x00), REVERSE_BITS_6(0x02), REVERSE_BITS_6(0x01), REVERSE_BITS_6(0x03)
+};
+
 static void AdvanceMetatilePosition(int *subTileX, int *subTileY, int *metatileX, int *metatileY, int metatilesWide, int metatileWidth, int metatileHeight)
 {
 	(*subTileX)++;
@@ -36,172 +45,169 @@ static void AdvanceMetatilePosition(int *subTileX, int *subTileY, int *metatileX
 	}
 }
 
-static void ConvertFromTiles1Bpp(unsigned char *src, unsigned char *dest, int numTiles, int metatilesWide, int metatileWidth, int metatileHeight, bool invertColors)
+// Returns the offset in the image of the top-left pixel row of each tile, in
+// the order the tiles are stored. rowSize is the size in bytes of one 8-pixel
+// row of a tile.
+static int *GetTileOffsets(int numTiles, int metatilesWide, int metatileWidth, int metatileHeight, int rowSize)
 {
+	int *offsets = malloc(numTiles * sizeof(int));
+
+	if (offsets == NULL && numTiles > 0)
+		FATAL_ERROR("Failed to allocate memory for tile offsets.\n");
+
 	int subTileX = 0;
 	int subTileY = 0;
 	int metatileX = 0;
 	int metatileY = 0;
+	int pitch = (metatilesWide * metatileWidth) * rowSize;
+
+	for (int i = 0; i < numTiles; i++) {
+		int tileX = metatileX * metatileWidth + subTileX;
+		int tileY = metatileY * metatileHeight + subTileY;
+
+		offsets[i] = tileY * 8 * pitch + tileX * rowSize;
+
+		AdvanceMetatilePosition(&subTileX, &subTileY, &metatileX, &metatileY, metatilesWide, metatileWidth, metatileHeight);
+	}
+
+	return offsets;
+}
+
+// Swaps the two pixels in each byte of a 4bpp row.
+static inline uint32_t SwapPixelPairs(uint32_t row)
+{
+	return ((row >> 4) & 0x0F0F0F0F) | ((row << 4) & 0xF0F0F0F0);
+}
+
+// Inverting a color index is the same as flipping all of its bits, so the
+// kernels below XOR whole rows with a mask that's zero when not inverting.
+
+static void ConvertFromTiles1Bpp(unsigned char *src, unsigned char *dest, int numTiles, int metatilesWide, int metatileWidth, int metatileHeight, bool invertColors)
+{
+	int *offsets = GetTileOffsets(numTiles, metatilesWide, metatileWidth, metatileHeight, 1);
 	int pitch = metatilesWide * metatileWidth;
+	unsigned char invertMask = invertColors ? 0xFF : 0;
 
 	for (int i = 0; i < numTiles; i++) {
+		unsigned char *destRow = dest + offsets[i];
+
 		for (int j = 0; j < 8; j++) {
-			int destY = (metatileY * metatileHeight + subTileY) * 8 + j;
-			int destX = metatileX * metatileWidth + subTileX;
-			unsigned char srcPixelOctet = *src++;
-			unsigned char *destPixelOctet = &dest[destY * pitch + destX];
-
-			for (int k = 0; k < 8; k++) {
-				*destPixelOctet <<= 1;
-				*destPixelOctet |= (srcPixelOctet & 1) ^ invertColors;
-				srcPixelOctet >>= 1;
-			}
+			*destRow = sReversedBits[*src++] ^ invertMask;
+			destRow += pitch;
 		}
-
-		AdvanceMetatilePosition(&subTileX, &subTileY, &metatileX, &metatileY, metatilesWide, metatileWidth, metatileHeight);
 	}
+
+	free(offsets);
 }
 
 static void ConvertFromTiles4Bpp(unsigned char *src, unsigned char *dest, int numTiles, int metatilesWide, int metatileWidth, int metatileHeight, bool invertColors)
 {
-	int subTileX = 0;
-	int subTileY = 0;
-	int metatileX = 0;
-	int metatileY = 0;
+	int *offsets = GetTileOffsets(numTiles, metatilesWide, metatileWidth, metatileHeight, 4);
 	int pitch = (metatilesWide * metatileWidth) * 4;
+	uint32_t invertMask = invertColors ? 0xFFFFFFFF : 0;
 
 	for (int i = 0; i < numTiles; i++) {
-		for (int j = 0; j < 8; j++) {
-			int destY = (metatileY * metatileHeight + subTileY) * 8 + j;
-
-			for (int k = 0; k < 4; k++) {
-				int destX = (metatileX * metatileWidth + subTileX) * 4 + k;
-				unsigned char srcPixelPair = *src++;
-				unsigned char leftPixel = srcPixelPair & 0xF;
-				unsigned char rightPixel = srcPixelPair >> 4;
+		unsigned char *destRow = dest + offsets[i];
 
-				if (invertColors) {
-					leftPixel = 15 - leftPixel;
-					rightPixel = 15 - rightPixel;
-				}
+		for (int j = 0; j < 8; j++) {
+			uint32_t row;
 
-				dest[destY * pitch + destX] = (leftPixel << 4) | rightPixel;
-			}
+			memcpy(&row, src, 4);
+			row = SwapPixelPairs(row) ^ invertMask;
+			memcpy(destRow, &row, 4);
+			src += 4;
+			destRow += pitch;
 		}
-
-		AdvanceMetatilePosition(&subTileX, &subTileY, &metatileX, &metatileY, metatilesWide, metatileWidth, metatileHeight);
 	}
+
+	free(offsets);
 }
 
 static void ConvertFromTiles8Bpp(unsigned char *src, unsigned char *dest, int numTiles, int metatilesWide, int metatileWidth, int metatileHeight, bool invertColors)
 {
-	int subTileX = 0;
-	int subTileY = 0;
-	int metatileX = 0;
-	int metatileY = 0;
+	int *offsets = GetTileOffsets(numTiles, metatilesWide, metatileWidth, metatileHeight, 8);
 	int pitch = (metatilesWide * metatileWidth) * 8;
+	uint64_t invertMask = invertColors ? UINT64_MAX : 0;
 
 	for (int i = 0; i < numTiles; i++) {
-		for (int j = 0; j < 8; j++) {
-			int destY = (metatileY * metatileHeight + subTileY) * 8 + j;
+		unsigned char *destRow = dest + offsets[i];
 
-			for (int k = 0; k < 8; k++) {
-				int destX = (metatileX * metatileWidth + subTileX) * 8 + k;
-				unsigned char srcPixel = *src++;
-
-				if (invertColors)
-					srcPixel = 255 - srcPixel;
+		for (int j = 0; j < 8; j++) {
+			uint64_t row;
 
-				dest[destY * pitch + destX] = srcPixel;
-			}
+			memcpy(&row, src, 8);
+			row ^= invertMask;
+			memcpy(destRow, &row, 8);
+			src += 8;
+			destRow += pitch;
 		}
-
-		AdvanceMetatilePosition(&subTileX, &subTileY, &metatileX, &metatileY, metatilesWide, metatileWidth, metatileHeight);
 	}
+
+	free(offsets);
 }
 
 static void ConvertToTiles1Bpp(unsigned char *src, unsigned char *dest, int numTiles, int metatilesWide, int metatileWidth, int metatileHeight, bool invertColors)
 {
-	int subTileX = 0;
-	int subTileY = 0;
-	int metatileX = 0;
-	int metatileY = 0;
+	int *offsets = GetTileOffsets(numTiles, metatilesWide, metatileWidth, metatileHeight, 1);
 	int pitch = metatilesWide * metatileWidth;
+	unsigned char invertMask = invertColors ? 0xFF : 0;
 
 	for (int i = 0; i < numTiles; i++) {
+		unsigned char *srcRow = src + offsets[i];
+
 		for (int j = 0; j < 8; j++) {
-			int srcY = (metatileY * metatileHeight + subTileY) * 8 + j;
-			int srcX = metatileX * metatileWidth + subTileX;
-			unsigned char srcPixelOctet = src[srcY * pitch + srcX];
-			unsigned char *destPixelOctet = dest++;
-
-			for (int k = 0; k < 8; k++) {
-				*destPixelOctet <<= 1;
-				*destPixelOctet |= (srcPixelOctet & 1) ^ invertColors;
-				srcPixelOctet >>= 1;
-			}
+			*dest++ = sReversedBits[*srcRow] ^ invertMask;
+			srcRow += pitch;
 		}
-
-		AdvanceMetatilePosition(&subTileX, &subTileY, &metatileX, &metatileY, metatilesWide, metatileWidth, metatileHeight);
 	}
+
+	free(offsets);
 }
 
 static void ConvertToTiles4Bpp(unsigned char *src, unsigned char *dest, int numTiles, int metatilesWide, int metatileWidth, int metatileHeight, bool invertColors)
 {
-	int subTileX = 0;
-	int subTileY = 0;
-	int metatileX = 0;
-	int metatileY = 0;
+	int *offsets = GetTileOffsets(numTiles, metatilesWide, metatileWidth, metatileHeight, 4);
 	int pitch = (metatilesWide * metatileWidth) * 4;
+	uint32_t invertMask = invertColors ? 0xFFFFFFFF : 0;
 
 	for (int i = 0; i < numTiles; i++) {
-		for (int j = 0; j < 8; j++) {
-			int srcY = (metatileY * metatileHeight + subTileY) * 8 + j;
-
-			for (int k = 0; k < 4; k++) {
-				int srcX = (metatileX * metatileWidth + subTileX) * 4 + k;
-				unsigned char srcPixelPair = src[srcY * pitch + srcX];
-				unsigned char leftPixel = srcPixelPair >> 4;
-				unsigned char rightPixel = srcPixelPair & 0xF;
+		unsigned char *srcRow = src + offsets[i];
 
-				if (invertColors) {
-					leftPixel = 15 - leftPixel;
-					rightPixel = 15 - rightPixel;
-				}
+		for (int j = 0; j < 8; j++) {
+			uint32_t row;
 
-				*dest++ = (rightPixel << 4) | leftPixel;
-			}
+			memcpy(&row, srcRow, 4);
+			row = SwapPixelPairs(row) ^ invertMask;
+			memcpy(dest, &row, 4);
+			dest += 4;
+			srcRow += pitch;
 		}
-
-		AdvanceMetatilePosition(&subTileX, &subTileY, &metatileX, &metatileY, metatilesWide, metatileWidth, metatileHeight);
 	}
+
+	free(offsets);
 }
 
 static void ConvertToTiles8Bpp(unsigned char *src, unsigned char *dest, int numTiles, int metatilesWide, int metatileWidth, int metatileHeight, bool invertColors)
 {
-	int subTileX = 0;
-	int subTileY = 0;
-	int metatileX = 0;
-	int metatileY = 0;
+	int *offsets = GetTileOffsets(numTiles, metatilesWide, metatileWidth, metatileHeight, 8);
 	int pitch = (metatilesWide * metatileWidth) * 8;
+	uint64_t invertMask = invertColors ? UINT64_MAX : 0;
 
 	for (int i = 0; i < numTiles; i++) {
-		for (int j = 0; j < 8; j++) {
-			int srcY = (metatileY * metatileHeight + subTileY) * 8 + j;
-
-			for (int k = 0; k < 8; k++) {
-				int srcX = (metatileX * metatileWidth + subTileX) * 8 + k;
-				unsigned char srcPixel = src[srcY * pitch + srcX];
+		unsigned char *srcRow = src + offsets[i];
 
-				if (invertColors)
-					srcPixel = 255 - srcPixel;
+		for (int j = 0; j < 8; j++) {
+			uint64_t row;
 
-				*dest++ = srcPixel;
-			}
+			memcpy(&row, srcRow, 8);
+			row ^= invertMask;
+			memcpy(dest, &row, 8);
+			dest += 8;
+			srcRow += pitch;
 		}
-
-		AdvanceMetatilePosition(&subTileX, &subTileY, &metatileX, &metatileY, metatilesWide, metatileWidth, metatileHeight);
 	}
+
+	free(offsets);
 }
 
 // For untiled, plain images
@@ -357,6 +363,152 @@ static unsigned char *DecodeTilemap(unsigned char *tiles, struct Tilemap *tilema
     return decoded;
 }
 
+// Copies an 8x8 tile with one byte per pixel, flipping it and masking each pixel.
+static void FlipTilePixels(unsigned char *src, unsigned char *dest, bool hflip, bool vflip, unsigned char pixelMask)
+{
+    for (int y = 0; y < 8; y++)
+    {
+        unsigned char *srcRow = &src[(vflip ? 7 - y : y) * 8];
+
+        for (int x = 0; x < 8; x++)
+            *dest++ = srcRow[hflip ? 7 - x : x] & pixelMask;
+    }
+}
+
+static uint32_t HashTilePixels(unsigned char *pixels)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+
+    for (int i = 0; i < 64; i++)
+    {
+        hash ^= pixels[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+// Returns the slot in the hash table where the tile is or would be stored.
+static int FindTileSlot(int *table, int tableMask, unsigned char *uniqueTiles, unsigned char *pixels)
+{
+    int slot = HashTilePixels(pixels) & tableMask;
+
+    while (table[slot] != -1 && memcmp(&uniqueTiles[table[slot] * 64], pixels, 64) != 0)
+        slot = (slot + 1) & tableMask;
+
+    return slot;
+}
+
+// Takes 8bpp tiles with one byte per pixel and removes the ones that repeat an
+// earlier tile, or a flipped version of it for non-affine maps. Returns the
+// remaining tiles at the given bit depth and the tilemap that rebuilds the
+// original tiles from them. For 4bpp tiles, the upper four bits of the pixels
+// are the palette number, which must be the same across each tile.
+unsigned char *GenerateTilemap(unsigned char *tiles, int numTiles, int bitDepth, bool isAffine, bool invertColors, int *dataSize, unsigned char **tilemap, int *tilemapSize)
+{
+    int maxNumUniqueTiles = isAffine ? 256 : 1024;
+    int numFlips = isAffine ? 1 : 4;
+    unsigned char pixelMask = bitDepth == 4 ? 0xF : 0xFF;
+    unsigned char invertMask = invertColors ? 0xFF : 0;
+    int tableSize = 2;
+
+    while (tableSize < numTiles * 2)
+        tableSize *= 2;
+
+    int *table = malloc(tableSize * sizeof(int));
+    unsigned char *uniqueTiles = malloc(numTiles * 64 + 1);
+    int mapEntrySize = isAffine ? 1 : 2;
+
+    *tilemapSize = numTiles * mapEntrySize;
+    *tilemap = malloc(*tilemapSize + 1);
+
+    if (table == NULL || uniqueTiles == NULL || *tilemap == NULL)
+        FATAL_ERROR("Failed to allocate memory for tilemap.\n");
+
+    memset(table, -1, tableSize * sizeof(int));
+
+    int numUniqueTiles = 0;
+
+    for (int i = 0; i < numTiles; i++)
+    {
+        unsigned char *tile = &tiles[i * 64];
+        int palno = 0;
+
+        if (bitDepth == 4)
+        {
+            // Compare the colors as they are in the image, before inverting.
+            palno = (tile[0] ^ invertMask) >> 4;
+
+            for (int j = 1; j < 64; j++)
+            {
+                if (((tile[j] ^ invertMask) >> 4) != palno)
+                    FATAL_ERROR("Tile %d uses colors from more than one palette.\n", i + 1);
+            }
+        }
+
+        unsigned char flipped[64];
+        int flip;
+        int slot = -1;
+
+        // Each flip is its own inverse, so if flipping this tile gives a
+        // stored tile, flipping that one the same way gives back this tile.
+        for (flip = 0; flip < numFlips; flip++)
+        {
+            FlipTilePixels(tile, flipped, flip & 1, flip & 2, pixelMask);
+            slot = FindTileSlot(table, tableSize - 1, uniqueTiles, flipped);
+
+            if (table[slot] != -1)
+                break;
+        }
+
+        if (flip == numFlips)
+        {
+            if (numUniqueTiles == maxNumUniqueTiles)
+                FATAL_ERROR("The image has more than %d unique tiles.\n", maxNumUniqueTiles);
+
+            flip = 0;
+            FlipTilePixels(tile, &uniqueTiles[numUniqueTiles * 64], false, false, pixelMask);
+            slot = FindTileSlot(table, tableSize - 1, uniqueTiles, &uniqueTiles[numUniqueTiles * 64]);
+            table[slot] = numUniqueTiles++;
+        }
+
+        if (isAffine)
+        {
+            (*tilemap)[i] = table[slot];
+        }
+        else
+        {
+            int entry = table[slot] | ((flip & 1) << 10) | ((flip >> 1) << 11) | (palno << 12);
+
+            (*tilemap)[i * 2] = (unsigned char)entry;
+            (*tilemap)[i * 2 + 1] = (unsigned char)(entry >> 8);
+        }
+    }
+
+    *dataSize = numUniqueTiles * bitDepth * 8;
+
+    unsigned char *data = malloc(*dataSize + 1);
+
+    if (data == NULL)
+        FATAL_ERROR("Failed to allocate memory for tiles.\n");
+
+    if (bitDepth == 4)
+    {
+        for (int i = 0; i < *dataSize; i++)
+            data[i] = uniqueTiles[i * 2] | (uniqueTiles[i * 2 + 1] << 4);
+    }
+    else
+    {
+        memcpy(data, uniqueTiles, *dataSize);
+    }
+
+    free(table);
+    free(uniqueTiles);
+
+    return data;
+}
+
 void ReadTileImage(char *path, int tilesWidth, int metatileWidth, int metatileHeight, struct Image *image, bool invertColors)
 {
 	int tileSize = image->bitDepth * 8;
@@ -408,7 +560,7 @@ void ReadTileImage(char *path, int tilesWidth, int metatileWidth, int metatileHe
 	free(buffer);
 }
 
-void WriteTileImage(char *path, enum NumTilesMode numTilesMode, int numTiles, int metatileWidth, int metatileHeight, struct Image *image, bool invertColors)
+unsigned char *GetTileImageData(enum NumTilesMode numTilesMode, int numTiles, int metatileWidth, int metatileHeight, struct Image *image, bool invertColors, int *dataSize)
 {
 	int tileSize = image->bitDepth * 8;
 
@@ -464,7 +616,7 @@ void WriteTileImage(char *path, enum NumTilesMode numTilesMode, int numTiles, in
 			case NUM_TILES_IGNORE:
 				break;
 			case NUM_TILES_WARN:
-				fprintf(stderr, "Ignoring -num_tiles %d because tile %d contains non-transparent pixels.\n", numTiles, 1 + i / tileSize);
+				Warn("Ignoring -num_tiles %d because tile %d contains non-transparent pixels.\n", numTiles, 1 + i / tileSize);
 				zeroPadded = false;
 				break;
 			case NUM_TILES_ERROR:
@@ -474,7 +626,16 @@ void WriteTileImage(char *path, enum NumTilesMode numTilesMode, int numTiles, in
 		}
 	}
 
-	WriteWholeFile(path, buffer, zeroPadded ? bufferSize : maxBufferSize);
+	*dataSize = zeroPadded ? bufferSize : maxBufferSize;
+	return buffer;
+}
+
+void WriteTileImage(char *path, enum NumTilesMode numTilesMode, int numTiles, int metatileWidth, int metatileHeight, struct Image *image, bool invertColors)
+{
+	int bufferSize;
+	unsigned char *buffer = GetTileImageData(numTilesMode, numTiles, metatileWidth, metatileHeight, image, invertColors, &bufferSize);
+
+	WriteWholeFile(path, buffer, bufferSize);
 
 	free(buffer);
 }
@@ -505,7 +666,7 @@ void ReadPlainImage(char *path, int dataWidth, struct Image *image, bool invertC
 	free(buffer);
 }
 
-void WritePlainImage(char *path, int dataWidth, struct Image *image, bool invertColors)
+unsigned char *GetPlainImageData(int dataWidth, struct Image *image, bool invertColors, int *dataSize)
 {
 	int bufferSize = image->width * image->height * image->bitDepth / 8;
 
@@ -525,6 +686,15 @@ void WritePlainImage(char *path, int dataWidth, struct Image *image, bool invert
 
 	CopyPlainPixels(image->pixels, buffer, bufferSize, dataWidth, invertColors);
 
+	*dataSize = bufferSize;
+	return buffer;
+}
+
+void WritePlainImage(char *path, int dataWidth, struct Image *image, bool invertColors)
+{
+	int bufferSize;
+	unsigned char *buffer = GetPlainImageData(dataWidth, image, invertColors, &bufferSize);
+
 	WriteWholeFile(path, buffer, bufferSize);
 
 	free(buffer);
@@ -567,12 +737,12 @@ void ReadGbaPalette(char *path, struct Palette *palette)
 	free(data);
 }
 
-void WriteGbaPalette(char *path, struct Palette *palette)
+unsigned char *GetGbaPaletteData(struct Palette *palette, int *dataSize)
 {
-	FILE *fp = fopen(path, "wb");
+	unsigned char *buffer = malloc(palette->numColors * 2 + 1);
 
-	if (fp == NULL)
-		FATAL_ERROR("Failed to open \"%s\" for writing.\n", path);
+	if (buffer == NULL)
+		FATAL_ERROR("Failed to allocate memory for palette.\n");
 
 	for (int i = 0; i < palette->numColors; i++) {
 		unsigned char red = DOWNCONVERT_BIT_DEPTH(palette->colors[i].red);
@@ -581,9 +751,26 @@ void WriteGbaPalette(char *path, struct Palette *palette)
 
 		uint16_t paletteEntry = SET_GBA_PAL(red, green, blue);
 
-		fputc(paletteEntry & 0xFF, fp);
-		fputc(paletteEntry >> 8, fp);
+		buffer[i * 2] = paletteEntry & 0xFF;
+		buffer[i * 2 + 1] = paletteEntry >> 8;
 	}
 
+	*dataSize = palette->numColors * 2;
+	return buffer;
+}
+
+void WriteGbaPalette(char *path, struct Palette *palette)
+{
+	int bufferSize;
+	unsigned char *buffer = GetGbaPaletteData(palette, &bufferSize);
+	FILE *fp = fopen(path, "wb");
+
+	if (fp == NULL)
+		FATAL_ERROR("Failed to open \"%s\" for writing.\n", path);
+
+	if (bufferSize != 0 && fwrite(buffer, bufferSize, 1, fp) != 1)
+		FATAL_ERROR("Failed to write to \"%s\".\n", path);
+
 	fclose(fp);
+	free(buffer);
 }
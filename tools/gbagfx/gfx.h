@@ -51,11 +51,15 @@ enum NumTilesMode {
 };
 
 void ReadTileImage(char *path, int tilesWidth, int metatileWidth, int metatileHeight, struct Image *image, bool invertColors);
+unsigned char *GetTileImageData(enum NumTilesMode numTilesMode, int numTiles, int metatileWidth, int metatileHeight, struct Image *image, bool invertColors, int *dataSize);
+unsigned char *GenerateTilemap(unsigned char *tiles, int numTiles, int bitDepth, bool isAffine, bool invertColors, int *dataSize, unsigned char **tilemap, int *tilemapSize);
 void WriteTileImage(char *path, enum NumTilesMode numTilesMode, int numTiles, int metatileWidth, int metatileHeight, struct Image *image, bool invertColors);
 void ReadPlainImage(char *path, int dataWidth, struct Image *image, bool invertColors);
+unsigned char *GetPlainImageData(int dataWidth, struct Image *image, bool invertColors, int *dataSize);
 void WritePlainImage(char *path, int dataWidth, struct Image *image, bool invertColors);
 void FreeImage(struct Image *image);
 void ReadGbaPalette(char *path, struct Palette *palette);
+unsigned char *GetGbaPaletteData(struct Palette *palette, int *dataSize);
 void WriteGbaPalette(char *path, struct Palette *palette);
 
 #endif // GFX_H
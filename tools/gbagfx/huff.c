@@ -1,4 +1,5 @@
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
@@ -6,151 +7,237 @@
 #include "global.h"
 #include "huff.h"
 
-static int cmp_tree(const void * a0, const void * b0) {
-    return ((struct HuffData *)a0)->value - ((struct HuffData *)b0)->value;
+/*
+ * Nodes are kept in a binary min-heap ordered by frequency.  Ties go to the
+ * node created first, with the leaves created in symbol order before any
+ * branches.  That's the order the original encoder's stable sort gave, so the
+ * trees (and the output) come out the same.
+ */
+struct HuffHeap {
+    int * items;
+    int count;
+    HuffNode_t * nodes;
+};
+
+static bool heap_less(struct HuffHeap * heap, int a, int b) {
+    unsigned aValue = heap->nodes[a].header.value;
+    unsigned bValue = heap->nodes[b].header.value;
+    return aValue < bValue || (aValue == bValue && a < b);
 }
 
-typedef int (*cmpfun)(const void *, const void *);
+static void heap_push(struct HuffHeap * heap, int node) {
+    int i = heap->count++;
+    while (i > 0 && heap_less(heap, node, heap->items[(i - 1) / 2])) {
+        heap->items[i] = heap->items[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap->items[i] = node;
+}
 
-int msort_r(void * data, size_t count, size_t size, cmpfun cmp, void * buffer) {
-    /*
-     * Out-of-place mergesort (stable sort)
-     * Returns 1 on success, 0 on failure
-     */
-    void * leftPtr;
-    void * rightPtr;
-    void * leftEnd;
-    void * rightEnd;
-    int i;
-
-    switch (count) {
-    case 0:
-        // Should never be here
-        return 0;
-
-    case 1:
-        // Nothing to do here
-        break;
-
-    case 2:
-        // Swap the two entries if the right one compares higher.
-        if (cmp(data, data + size) > 0) {
-            memcpy(buffer, data, size);
-            memcpy(data, data + size, size);
-            memcpy(data + size, buffer, size);
+static int heap_pop(struct HuffHeap * heap) {
+    int top = heap->items[0];
+    int last = heap->items[--heap->count];
+    int i = 0;
+    for (;;) {
+        int child = i * 2 + 1;
+        if (child >= heap->count)
+            break;
+        if (child + 1 < heap->count && heap_less(heap, heap->items[child + 1], heap->items[child]))
+            child++;
+        if (!heap_less(heap, heap->items[child], last))
+            break;
+        heap->items[i] = heap->items[child];
+        i = child;
+    }
+    heap->items[i] = last;
+    return top;
+}
+
+// Builds the Huffman tree for the leaves in nodes[0..nleaves-1], using the
+// rest of nodes for the branches.  Returns the root.
+static HuffNode_t * build_tree(HuffNode_t * nodes, int nleaves) {
+    struct HuffHeap heap;
+    heap.items = malloc(nleaves * sizeof(int));
+    heap.count = 0;
+    heap.nodes = nodes;
+    if (heap.items == NULL)
+        FATAL_ERROR("Fatal error while compressing Huff file.\n");
+
+    for (int i = 0; i < nleaves; i++)
+        heap_push(&heap, i);
+
+    int nnodes = nleaves;
+    while (heap.count > 1) {
+        int smallest = heap_pop(&heap);
+        int nextSmallest = heap_pop(&heap);
+        HuffNode_t * branch = &nodes[nnodes];
+        branch->header.isLeaf = 0;
+        branch->header.value = nodes[smallest].header.value + nodes[nextSmallest].header.value;
+        branch->branch.left = &nodes[nextSmallest];
+        branch->branch.right = &nodes[smallest];
+        heap_push(&heap, nnodes++);
+    }
+
+    free(heap.items);
+    return &nodes[nnodes - 1];
+}
+
+/*
+ * Builds a tree whose codes are at most maxLength bits, using package-merge to
+ * find the optimal code lengths and then placing the leaves canonically.
+ */
+static HuffNode_t * build_length_limited_tree(HuffNode_t * nodes, int nleaves, int maxLength) {
+    int * lengths = calloc(nleaves, sizeof(int));
+    int * order = malloc(nleaves * sizeof(int));
+    // Each package is a weight plus how many times each leaf appears in it.
+    int maxItems = 2 * nleaves;
+    unsigned long long * weights = malloc(maxItems * sizeof(unsigned long long));
+    unsigned long long * newWeights = malloc(maxItems * sizeof(unsigned long long));
+    int * counts = malloc(maxItems * nleaves * sizeof(int));
+    int * newCounts = malloc(maxItems * nleaves * sizeof(int));
+    if (lengths == NULL || order == NULL || weights == NULL || newWeights == NULL || counts == NULL || newCounts == NULL)
+        FATAL_ERROR("Fatal error while compressing Huff file.\n");
+
+    for (int i = 0; i < nleaves; i++)
+        order[i] = i;
+    // Sort the leaves by frequency.  Every leaf has a length of 0 here.
+    for (int i = 1; i < nleaves; i++) {
+        int leaf = order[i];
+        int j = i;
+        while (j > 0 && nodes[order[j - 1]].header.value > nodes[leaf].header.value) {
+            order[j] = order[j - 1];
+            j--;
         }
-        break;
-    default:
-        // Merge sort out-of-place.
-        leftPtr = data;
-        leftEnd = rightPtr = data + count / 2 * size;
-        rightEnd = data + count * size;
-
-        // Sort the left half
-        if (!msort_r(leftPtr, count / 2, size, cmp, buffer))
-            return 0;
-
-        // Sort the right half
-        if (!msort_r(rightPtr, count / 2 + (count & 1), size, cmp, buffer))
-            return 0;
-
-        // Merge the sorted halves out of place
-        i = 0;
-        do {
-            if (cmp(leftPtr, rightPtr) <= 0) {
-                memcpy(buffer + i * size, leftPtr, size);
-                leftPtr += size;
+        order[j] = leaf;
+    }
+
+    int nitems = 0;
+    for (int level = 0; level < maxLength; level++) {
+        // Pair up the previous level's items, then merge in the leaves.
+        int npackages = nitems / 2;
+        int p = 0, l = 0, n = 0;
+        while (p < npackages || l < nleaves) {
+            int * dest = &newCounts[n * nleaves];
+            if (l < nleaves && (p == npackages || nodes[order[l]].header.value <= weights[p * 2] + weights[p * 2 + 1])) {
+                memset(dest, 0, nleaves * sizeof(int));
+                dest[order[l]] = 1;
+                newWeights[n] = nodes[order[l]].header.value;
+                l++;
             } else {
-                memcpy(buffer + i * size, rightPtr, size);
-                rightPtr += size;
+                for (int i = 0; i < nleaves; i++)
+                    dest[i] = counts[(p * 2) * nleaves + i] + counts[(p * 2 + 1) * nleaves + i];
+                newWeights[n] = weights[p * 2] + weights[p * 2 + 1];
+                p++;
             }
+            n++;
+        }
+        nitems = n;
+        int * tmpCounts = counts;
+        counts = newCounts;
+        newCounts = tmpCounts;
+        unsigned long long * tmpWeights = weights;
+        weights = newWeights;
+        newWeights = tmpWeights;
+    }
 
-        } while (++i < count && leftPtr < leftEnd && rightPtr < rightEnd);
+    for (int i = 0; i < 2 * nleaves - 2; i++) {
+        for (int j = 0; j < nleaves; j++)
+            lengths[j] += counts[i * nleaves + j];
+    }
 
-        // Copy the remainder
-        if (i < count) {
-            if (leftPtr < leftEnd) {
-                memcpy(buffer + i * size, leftPtr, leftEnd - leftPtr);
-            }
-            else {
-                memcpy(buffer + i * size, rightPtr, rightEnd - rightPtr);
-            }
+    // Give out codes in order of length, and build the tree along each code.
+    for (int i = 0; i < nleaves; i++)
+        order[i] = i;
+    for (int i = 1; i < nleaves; i++) {
+        int leaf = order[i];
+        int j = i;
+        while (j > 0 && lengths[order[j - 1]] > lengths[leaf]) {
+            order[j] = order[j - 1];
+            j--;
         }
+        order[j] = leaf;
+    }
 
-        // Copy the merged data back
-        memcpy(data, buffer, count * size);
-        break;
+    HuffNode_t * root = &nodes[nleaves];
+    int nnodes = nleaves + 1;
+    unsigned long long code = 0;
+    root->header.isLeaf = 0;
+    root->branch.left = root->branch.right = NULL;
+
+    for (int i = 0; i < nleaves; i++) {
+        int leaf = order[i];
+        if (i > 0)
+            code = (code + 1) << (lengths[leaf] - lengths[order[i - 1]]);
+        HuffNode_t * node = root;
+        for (int depth = lengths[leaf] - 1; depth >= 0; depth--) {
+            HuffNode_t ** child = ((code >> depth) & 1) ? &node->branch.right : &node->branch.left;
+            if (depth == 0) {
+                *child = &nodes[leaf];
+            } else {
+                if (*child == NULL) {
+                    *child = &nodes[nnodes++];
+                    (*child)->header.isLeaf = 0;
+                    (*child)->branch.left = (*child)->branch.right = NULL;
+                }
+                node = *child;
+            }
+        }
     }
 
-    return 1;
-}
+    free(lengths);
+    free(order);
+    free(weights);
+    free(newWeights);
+    free(counts);
+    free(newCounts);
 
-int msort(void * data, size_t count, size_t size, cmpfun cmp) {
-    void * buffer = malloc(count * size);
-    if (buffer == NULL) return 0;
-    int result = msort_r(data, count, size, cmp, buffer);
-    free(buffer);
-    return result;
+    return root;
 }
 
-static void write_tree(unsigned char * dest, HuffNode_t * tree, int nitems, struct BitEncoding * encoding) {
+static bool write_tree(unsigned char * dest, HuffNode_t * tree, int nitems, struct BitEncoding * encoding) {
     /*
      * The example used to guide this function encodes the tree in a
-     * breadth-first manner.  We attempt to emulate that here.
+     * breadth-first manner, each node's children side by side with the left
+     * one first.  Codes are assigned along the way.  Returns false if a
+     * branch ends up too far from its children to encode.
      */
 
-    int i, j, k;
-
-    // There are (2 * nitems - 1) nodes in the binary tree.  Allocate that.
-    HuffNode_t * traversal = calloc(2 * nitems - 1, sizeof(HuffNode_t));
-    if (traversal == NULL)
+    int nnodes = 2 * nitems - 1;
+    HuffNode_t ** traversal = malloc(nnodes * sizeof(HuffNode_t *));
+    struct BitEncoding * paths = malloc(nnodes * sizeof(struct BitEncoding));
+    int * rightChild = malloc(nnodes * sizeof(int));
+    if (traversal == NULL || paths == NULL || rightChild == NULL)
         FATAL_ERROR("Fatal error while compressing Huff file.\n");
 
-    // The first node is the root of the tree.
-    traversal[0] = *tree;
-    i = 1;
-
-    // Copy the tree into a breadth-first ordering using brute force.
-    for (int depth = 1; i < 2 * nitems - 1; depth++) {
-        // Consider every possible path up to the current depth.
-        for (j = 0; i < 2 * nitems - 1 && j < 1 << depth; j++) {
-            // The index of the path is used to encode the path itself.
-            // Start from the most significant relevant bit and work our way down.
-            // Keep track of the current and previous nodes.
-            HuffNode_t * currNode = traversal;
-            HuffNode_t * parent = NULL;
-            for (k = 0; k < depth; k++) {
-                if (currNode->header.isLeaf)
-                    break;
-                parent = currNode;
-                if ((j >> (depth - k - 1)) & 1)
-                    currNode = currNode->branch.right;
-                else
-                    currNode = currNode->branch.left;
-            }
-            // Check that the length of the current path equals the current depth.
-            if (k == depth) {
-                // Make sure we can encode the current branch.
-                // Bail here if we cannot.
-                // This is only applicable for 8-bit encodings.
-                if (traversal + i - parent > 128)
-                    FATAL_ERROR("Fatal error while compressing Huff file: unable to encode binary tree.\n");
-                // Copy the current node, and update its parent.
-                traversal[i] = *currNode;
-                if (parent != NULL) {
-                    if ((j & 1) == 1)
-                        parent->branch.right = traversal + i;
-                    else
-                        parent->branch.left = traversal + i;
-                }
-                // Encode the path through the tree in the lookup table
-                if (traversal[i].header.isLeaf) {
-                    encoding[traversal[i].leaf.key].nbits = depth;
-                    encoding[traversal[i].leaf.key].bitstring = j;
-                }
-                i++;
-            }
+    traversal[0] = tree;
+    paths[0].nbits = 0;
+    paths[0].bitstring = 0;
+
+    int count = 1;
+    for (int i = 0; i < count; i++) {
+        HuffNode_t * currNode = traversal[i];
+        if (currNode->header.isLeaf) {
+            encoding[currNode->leaf.key] = paths[i];
+            continue;
+        }
+        // Make sure we can encode the current branch.
+        // Bail here if we cannot.
+        // This is only applicable for 8-bit encodings.
+        if (count + 1 - i > 128) {
+            free(traversal);
+            free(paths);
+            free(rightChild);
+            return false;
         }
+        if (paths[i].nbits == 32)
+            FATAL_ERROR("Fatal error while compressing Huff file: codes are longer than 32 bits. Try -max_code_length.\n");
+        for (int bit = 0; bit < 2; bit++) {
+            traversal[count] = bit ? currNode->branch.right : currNode->branch.left;
+            paths[count].nbits = paths[i].nbits + 1;
+            paths[count].bitstring = (paths[i].bitstring << 1) | bit;
+            count++;
+        }
+        rightChild[i] = count - 1;
     }
 
     // Encode the size of the tree.
@@ -158,12 +245,12 @@ static void write_tree(unsigned char * dest, HuffNode_t * tree, int nitems, stru
     dest[4] = nitems - 1;
 
     // Encode each node in the tree.
-    for (i = 0; i < 2 * nitems - 1; i++) {
-        HuffNode_t * currNode = traversal + i;
+    for (int i = 0; i < nnodes; i++) {
+        HuffNode_t * currNode = traversal[i];
         if (currNode->header.isLeaf) {
-            dest[5 + i] = traversal[i].leaf.key;
+            dest[5 + i] = currNode->leaf.key;
         } else {
-            dest[5 + i] = (((currNode->branch.right - traversal - i) / 2) - 1);
+            dest[5 + i] = ((rightChild[i] - i) / 2) - 1;
             if (currNode->branch.left->header.isLeaf)
                 dest[5 + i] |= 0x80;
             if (currNode->branch.right->header.isLeaf)
@@ -172,6 +259,9 @@ static void write_tree(unsigned char * dest, HuffNode_t * tree, int nitems, stru
     }
 
     free(traversal);
+    free(paths);
+    free(rightChild);
+    return true;
 }
 
 static inline void write_32_le(unsigned char * dest, int * destPos, uint32_t * buff, int * buffPos) {
@@ -193,141 +283,150 @@ static inline void read_32_le(unsigned char * src, int * srcPos, uint32_t * buff
     *buff = tmp;
 }
 
-static void write_bits(unsigned char * dest, int * destPos, struct BitEncoding * encoding, int value, uint32_t * buff, int * buffBits) {
-    int nbits = encoding[value].nbits;
-    uint32_t bitstring = encoding[value].bitstring;
-
-    if (*buffBits + nbits >= 32) {
-        int diff = *buffBits + nbits - 32;
-        *buff <<= nbits - diff;
-        *buff |= bitstring >> diff;
-        bitstring &= ~(1 << diff);
-        nbits = diff;
-        write_32_le(dest, destPos, buff, buffBits);
-    }
-    if (nbits != 0) {
-        *buff <<= nbits;
-        *buff |= bitstring;
-        *buffBits += nbits;
-    }
-}
-
 /*
 =======================================
 MAIN COMPRESSION/DECOMPRESSION ROUTINES
 =======================================
  */
 
-unsigned char * HuffCompress(unsigned char * src, int srcSize, int * compressedSize_p, int bitDepth) {
+// Returns NULL if the tree has too many values to encode, which can happen
+// with 8-bit values.
+unsigned char * HuffCompress(unsigned char * src, int srcSize, int * compressedSize_p, int bitDepth, int maxCodeLength) {
     if (srcSize <= 0)
         goto fail;
 
-    int worstCaseDestSize = 4 + (2 << bitDepth) + srcSize * 3;
-
-    unsigned char *dest = malloc(worstCaseDestSize);
-    if (dest == NULL)
-        goto fail;
-
     int nitems = 1 << bitDepth;
 
-    HuffNode_t * freqs = calloc(nitems, sizeof(HuffNode_t));
-    if (freqs == NULL)
+    // Room for the leaves and the branches between them.
+    HuffNode_t * nodes = calloc(nitems * 2 - 1, sizeof(HuffNode_t));
+    if (nodes == NULL)
         goto fail;
 
     struct BitEncoding * encoding = calloc(nitems, sizeof(struct BitEncoding));
     if (encoding == NULL)
         goto fail;
 
-    // Set up the frequencies table.  This will inform the tree.
-    for (int i = 0; i < nitems; i++) {
-        freqs[i].header.isLeaf = 1;
-        freqs[i].header.value = 0;
-        freqs[i].leaf.key = i;
-    }
+    unsigned freqs[256] = {0};
 
     // Count each nybble or byte.
     for (int i = 0; i < srcSize; i++) {
         if (bitDepth == 8) {
-            freqs[src[i]].header.value++;
+            freqs[src[i]]++;
         } else {
-            freqs[src[i] >> 4].header.value++;
-            freqs[src[i] & 0xF].header.value++;
+            freqs[src[i] >> 4]++;
+            freqs[src[i] & 0xF]++;
         }
     }
 
 #ifdef DEBUG
     for (int i = 0; i < nitems; i++) {
-        fprintf(stderr, "%d: %d\n", i, freqs[i].header.value);
+        fprintf(stderr, "%d: %d\n", i, freqs[i]);
     }
 #endif // DEBUG
 
-    // Sort the frequency table.
-    if (!msort(freqs, nitems, sizeof(HuffNode_t), cmp_tree))
-        goto fail;
-
-    // Prune zero-frequency values.
+    // Make a leaf for each value that occurs.
+    int nleaves = 0;
     for (int i = 0; i < nitems; i++) {
-        if (freqs[i].header.value != 0) {
-            if (i > 0) {
-                for (int j = i; j < nitems; j++) {
-                    freqs[j - i] = freqs[j];
-                }
-                nitems -= i;
-            }
-            break;
+        if (freqs[i] != 0) {
+            nodes[nleaves].header.isLeaf = 1;
+            nodes[nleaves].header.value = freqs[i];
+            nodes[nleaves].leaf.key = i;
+            nleaves++;
         }
-        // This should never happen:
-        if (i == nitems - 1)
-            goto fail;
     }
 
-    HuffNode_t * tree = calloc(nitems * 2 - 1, sizeof(HuffNode_t));
-    if (tree == NULL)
-        goto fail;
+    // A tree needs at least two leaves, so data made of a single value gets
+    // a second, unused one.
+    if (nleaves == 1) {
+        nodes[1].header.isLeaf = 1;
+        nodes[1].header.value = 0;
+        nodes[1].leaf.key = nodes[0].leaf.key == 0 ? 1 : 0;
+        nleaves = 2;
+    }
 
-    // Iteratively collapse the two least frequent nodes.
-    HuffNode_t * endptr = freqs + nitems - 2;
-
-    for (int i = 0; i < nitems - 1; i++) {
-        HuffNode_t * left = freqs;
-        HuffNode_t * right = freqs + 1;
-        tree[i * 2] = *right;
-        tree[i * 2 + 1] = *left;
-        for (int j = 0; j < nitems - i - 2; j++)
-            freqs[j] = freqs[j + 2];
-        endptr->header.isLeaf = 0;
-        endptr->header.value = tree[i * 2].header.value + tree[i * 2 + 1].header.value;
-        endptr->branch.left = tree + i * 2;
-        endptr->branch.right = tree + i * 2 + 1;
-        endptr--;
-        if (i < nitems - 2 && !msort(freqs, nitems - i - 1, sizeof(HuffNode_t), cmp_tree))
-            goto fail;
+    HuffNode_t * tree;
+    if (maxCodeLength != 0 && nleaves > 1) {
+        if (maxCodeLength < 8 && (1 << maxCodeLength) < nleaves)
+            FATAL_ERROR("%d values can't be encoded with codes of at most %d bits.\n", nleaves, maxCodeLength);
+        tree = build_length_limited_tree(nodes, nleaves, maxCodeLength);
+    } else {
+        tree = build_tree(nodes, nleaves);
     }
 
+    // The data is encoded in whole words, so the end is padded with zeros.
+    int paddedSize = (srcSize + 3) & ~3;
+    unsigned char * padded = calloc(paddedSize, 1);
+    if (padded == NULL)
+        goto fail;
+    memcpy(padded, src, srcSize);
+
     // Write the tree breadth-first, and create the path lookup table.
-    write_tree(dest, freqs, nitems, encoding);
-
-    free(tree);
-    free(freqs);
-
-    // Encode the data itself.
-    int destPos = 4 + nitems * 2;
-    uint32_t destBuf = 0;
-    uint32_t srcBuf = 0;
-    int destBitPos = 0;
-
-    for (int srcPos = 0; srcPos < srcSize;) {
-        read_32_le(src, &srcPos, &srcBuf);
-        for (int i = 0; i < 32 / bitDepth; i++) {
-            write_bits(dest, &destPos, encoding, srcBuf & (0xFF >> (8 - bitDepth)), &destBuf, &destBitPos);
-            srcBuf >>= bitDepth;
+    int destPos = 4 + nleaves * 2;
+    unsigned char * dest = NULL;
+    uint64_t totalBits = 0;
+    struct BitEncoding byteCodes[256];
+
+    // Allocate space for the tree before writing it.
+    dest = calloc(destPos, 1);
+    if (dest == NULL)
+        goto fail;
+    if (!write_tree(dest, tree, nleaves, encoding)) {
+        free(dest);
+        free(padded);
+        free(nodes);
+        free(encoding);
+        return NULL;
+    }
+
+    // Precompute the code for each whole byte: one 8-bit value, or two 4-bit
+    // values with the low one first.
+    for (int i = 0; i < 256; i++) {
+        if (bitDepth == 8) {
+            byteCodes[i] = encoding[i];
+        } else {
+            struct BitEncoding lo = encoding[i & 0xF];
+            struct BitEncoding hi = encoding[i >> 4];
+            byteCodes[i].nbits = lo.nbits + hi.nbits;
+            byteCodes[i].bitstring = (lo.bitstring << hi.nbits) | hi.bitstring;
+        }
+    }
+
+    for (int i = 0; i < paddedSize; i++)
+        totalBits += byteCodes[padded[i]].nbits;
+
+    // The size is padded to a multiple of 4 bytes.
+    int destSize = (destPos + ((totalBits + 31) / 32) * 4 + 3) & ~3;
+    dest = realloc(dest, destSize);
+    if (dest == NULL)
+        goto fail;
+    memset(dest + destPos, 0, destSize - destPos);
+
+    // Encode the data itself, a whole byte at a time.  Codes are at most 32
+    // bits and at most 31 bits are pending, so they always fit.
+    uint64_t bits = 0;
+    int nbits = 0;
+
+    for (int i = 0; i < paddedSize; i++) {
+        struct BitEncoding code = byteCodes[padded[i]];
+        bits = (bits << code.nbits) | code.bitstring;
+        nbits += code.nbits;
+        if (nbits >= 32) {
+            nbits -= 32;
+            uint32_t word = bits >> nbits;
+            int unused;
+            write_32_le(dest, &destPos, &word, &unused);
         }
     }
 
-    if (destBitPos != 0) {
-        write_32_le(dest, &destPos, &destBuf, &destBitPos);
+    // The decompressor reads each word from the top bit down, so the last,
+    // partial word has to start at the top too.
+    if (nbits != 0) {
+        uint32_t word = bits << (32 - nbits);
+        write_32_le(dest, &destPos, &word, &nbits);
     }
 
+    free(padded);
+    free(nodes);
     free(encoding);
 
     // Write the header.
@@ -335,15 +434,60 @@ unsigned char * HuffCompress(unsigned char * src, int srcSize, int * compressedS
     dest[1] = srcSize;
     dest[2] = srcSize >> 8;
     dest[3] = srcSize >> 16;
-    *compressedSize_p = (destPos + 3) & ~3;
+    *compressedSize_p = destSize;
     return dest;
 
 fail:
     FATAL_ERROR("Fatal error while compressing Huff file.\n");
 }
 
+// Bits of lookahead resolved by one table lookup when decompressing.
+#define HUFF_LOOKUP_BITS 8
+
+struct HuffLookup {
+    unsigned char values[2];
+    unsigned char count;
+    unsigned char nbits;
+};
+
+// Follows one bit down the tree from the node at treePos.  Returns the new
+// position, which holds the value if *isLeaf is set.
+static inline int huff_step(unsigned char * src, int treePos, int bit, bool * isLeaf) {
+    unsigned char treeView = src[treePos];
+    *isLeaf = ((treeView << bit) & 0x80) != 0;
+    return (treePos & ~1) + ((treeView & 0x3F) + 1) * 2 + bit;
+}
+
+/*
+ * Fills the lookup table below the branch at treePos, reached by the given
+ * code, with one value per entry.  Entries for codes longer than the table
+ * get a count of 0.
+ */
+static void huff_fill_lookup(unsigned char * src, int treeEnd, struct HuffLookup * lookup, int treePos, int code, int depth) {
+    for (int bit = 0; bit < 2; bit++) {
+        bool isLeaf;
+        int childPos = huff_step(src, treePos, bit, &isLeaf);
+        int childCode = (code << 1) | bit;
+        int childDepth = depth + 1;
+
+        if (isLeaf || childDepth == HUFF_LOOKUP_BITS || childPos >= treeEnd) {
+            struct HuffLookup entry;
+            entry.count = isLeaf && childPos < treeEnd;
+            entry.values[0] = entry.count ? src[childPos] : 0;
+            entry.values[1] = 0;
+            entry.nbits = childDepth;
+            int first = childCode << (HUFF_LOOKUP_BITS - childDepth);
+            int count = 1 << (HUFF_LOOKUP_BITS - childDepth);
+            for (int i = 0; i < count; i++)
+                lookup[first + i] = entry;
+        } else {
+            huff_fill_lookup(src, treeEnd, lookup, childPos, childCode, childDepth);
+        }
+    }
+}
+
 unsigned char * HuffDecompress(unsigned char * src, int srcSize, int * uncompressedSize_p) {
-    if (srcSize < 4)
+    if (srcSize < 5)
         goto fail;
 
     int bitDepth = *src & 15;
@@ -351,48 +495,107 @@ unsigned char * HuffDecompress(unsigned char * src, int srcSize, int * uncompres
         goto fail;
 
     int destSize = (src[3] << 16) | (src[2] << 8) | src[1];
+    int numValues = destSize * (8 / bitDepth);
 
-    unsigned char *dest = malloc(destSize);
+    // One byte per value, with room for a value decoded past the end.
+    unsigned char *values = malloc(numValues + 2);
 
-    if (dest == NULL)
+    if (values == NULL)
         goto fail;
 
-    int treePos = 5;
     int treeSize = (src[4] + 1) * 2;
     int srcPos = 4 + treeSize;
-    int destPos = 0;
-    int curValPos = 0;
-    uint32_t destTmp = 0;
-    uint32_t window;
-
-    for (;;)
-    {
-        if (srcPos >= srcSize)
-            goto fail;
-        read_32_le(src, &srcPos, &window);
-        for (int i = 0; i < 32; i++) {
-            int curBit = (window >> 31) & 1;
-            unsigned char treeView = src[treePos];
-            bool isLeaf = ((treeView << curBit) & 0x80) != 0;
-            treePos &= ~1; // align
-            treePos += ((treeView & 0x3F) + 1) * 2 + curBit;
-            if (isLeaf) {
-                destTmp >>= bitDepth;
-                destTmp |= (src[treePos] << (32 - bitDepth));
-                curValPos++;
-                if (curValPos == 32 / bitDepth) {
-                    write_32_le(dest, &destPos, &destTmp, &curValPos);
-                    if (destPos == destSize) {
-                        *uncompressedSize_p = destSize;
-                        return dest;
-                    }
-                }
-                treePos = 5;
+    // Node positions are checked against this before they're read.
+    int treeEnd = srcPos < srcSize ? srcPos : srcSize;
+
+    if (treeEnd <= 5)
+        goto fail;
+
+    // Short codes are decoded by looking up the next HUFF_LOOKUP_BITS bits.
+    // When the first value's code leaves room for a second whole code, the
+    // entry has both values.
+    struct HuffLookup single[1 << HUFF_LOOKUP_BITS];
+    struct HuffLookup lookup[1 << HUFF_LOOKUP_BITS];
+
+    huff_fill_lookup(src, treeEnd, single, 5, 0, 0);
+
+    for (int i = 0; i < (1 << HUFF_LOOKUP_BITS); i++) {
+        struct HuffLookup first = single[i];
+        lookup[i] = first;
+        if (first.count != 0) {
+            struct HuffLookup second = single[(i << first.nbits) & ((1 << HUFF_LOOKUP_BITS) - 1)];
+            if (second.count != 0 && first.nbits + second.nbits <= HUFF_LOOKUP_BITS) {
+                lookup[i].values[1] = second.values[0];
+                lookup[i].count = 2;
+                lookup[i].nbits += second.nbits;
             }
-            window <<= 1;
         }
     }
 
+    uint64_t window = 0;
+    int windowBits = 0;
+    int i = 0;
+
+    while (i < numValues) {
+        // Keep more than 32 bits ahead while there's data left.
+        if (windowBits <= 32 && srcPos + 4 <= srcSize) {
+            uint32_t word;
+            read_32_le(src, &srcPos, &word);
+            window = (window << 32) | word;
+            windowBits += 32;
+        }
+
+        // Decode the values whose codes are entirely in the window and short
+        // enough for the table.
+        while (windowBits >= HUFF_LOOKUP_BITS && i < numValues) {
+            struct HuffLookup entry = lookup[(window >> (windowBits - HUFF_LOOKUP_BITS)) & ((1 << HUFF_LOOKUP_BITS) - 1)];
+            if (entry.count == 0)
+                break;
+            windowBits -= entry.nbits;
+            values[i] = entry.values[0];
+            values[i + 1] = entry.values[1];
+            i += entry.count;
+        }
+
+        if (i >= numValues)
+            break;
+
+        // Otherwise, walk the tree a bit at a time: the code is longer than
+        // the table, or it runs into the next word.
+        int treePos = 5;
+        bool isLeaf = false;
+        while (!isLeaf) {
+            if (windowBits == 0) {
+                if (srcPos + 4 > srcSize)
+                    goto fail;
+                uint32_t word;
+                read_32_le(src, &srcPos, &word);
+                window = word;
+                windowBits = 32;
+            }
+            windowBits--;
+            treePos = huff_step(src, treePos, (window >> windowBits) & 1, &isLeaf);
+            if (treePos >= treeEnd)
+                goto fail;
+        }
+        values[i++] = src[treePos];
+    }
+
+    unsigned char *dest = values;
+
+    // 4-bit values fill each byte from the bottom.
+    if (bitDepth == 4) {
+        dest = malloc(destSize + 1);
+        if (dest == NULL)
+            goto fail;
+        for (int j = 0; j < destSize; j++)
+            dest[j] = (values[j * 2] & 0xF) | (values[j * 2 + 1] << 4);
+        free(values);
+    }
+
+    *uncompressedSize_p = destSize;
+    return dest;
+
 fail:
     FATAL_ERROR("Fatal error while decompressing Huff file.\n");
 }
@@ -2,6 +2,7 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include "global.h"
 #include "lz.h"
 
@@ -12,7 +13,8 @@ unsigned char *LZDecompress(unsigned char *src, int srcSize, int *uncompressedSi
 
 	int destSize = (src[3] << 16) | (src[2] << 8) | src[1];
 
-	unsigned char *dest = malloc(destSize);
+	// Room for block copies to run over the end.
+	unsigned char *dest = malloc(destSize + 8);
 
 	if (dest == NULL)
 		goto fail;
@@ -26,6 +28,20 @@ unsigned char *LZDecompress(unsigned char *src, int srcSize, int *uncompressedSi
 
 		unsigned char flags = src[srcPos++];
 
+		// Eight literals in a row can be copied at once.
+		if (flags == 0 && srcPos + 8 <= srcSize && destPos + 8 <= destSize) {
+			memcpy(&dest[destPos], &src[srcPos], 8);
+			srcPos += 8;
+			destPos += 8;
+
+			if (destPos == destSize) {
+				*uncompressedSize = destSize;
+				return dest;
+			}
+
+			continue;
+		}
+
 		for (int i = 0; i < 8; i++) {
 			if (flags & 0x80) {
 				if (srcPos + 1 >= srcSize)
@@ -47,8 +63,19 @@ unsigned char *LZDecompress(unsigned char *src, int srcSize, int *uncompressedSi
 				if (blockPos < 0)
 					goto fail;
 
-				for (int j = 0; j < blockSize; j++)
-					dest[destPos++] = dest[blockPos + j];
+				// Blocks at least 8 bytes back are copied 8 bytes at a time.
+				// That can run up to 7 bytes past the block, into the slack
+				// at the end of dest, but whatever comes next overwrites it.
+				// Closer blocks overlap the bytes being written, so they're
+				// copied a byte at a time.
+				if (blockDistance >= 8) {
+					for (int j = 0; j < blockSize; j += 8)
+						memcpy(&dest[destPos + j], &dest[blockPos + j], 8);
+					destPos += blockSize;
+				} else {
+					for (int j = 0; j < blockSize; j++)
+						dest[destPos++] = dest[blockPos + j];
+				}
 			} else {
 				if (srcPos >= srcSize || destPos >= destSize)
 					goto fail;
@@ -69,7 +96,101 @@ fail:
 	FATAL_ERROR("Fatal error while decompressing LZ file.\n");
 }
 
-unsigned char *LZCompress(unsigned char *src, int srcSize, int *compressedSize, const int minDistance)
+// Matches are found through hash chains over the three bytes at each position.
+// Each chain lists earlier positions closest first, which is the order the
+// distances used to be tried in one by one, so ties still go to the closest match.
+#define LZ_HASH_BITS 14
+#define LZ_HASH_SIZE (1 << LZ_HASH_BITS)
+
+static inline int LZHash(const unsigned char *p)
+{
+	unsigned int value = (p[0] << 16) | (p[1] << 8) | p[2];
+
+	return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static void LZAddToChains(unsigned char *src, int srcSize, int *chainHeads, int *chainLinks, int *hashedPos, int srcPos)
+{
+	for (; *hashedPos < srcPos && *hashedPos + 3 <= srcSize; (*hashedPos)++) {
+		int hash = LZHash(&src[*hashedPos]);
+
+		chainLinks[*hashedPos] = chainHeads[hash];
+		chainHeads[hash] = *hashedPos;
+	}
+}
+
+// Returns the length of the longest match at srcPos that's at least
+// minDistance back, or less than 3 if there's nothing worth using.
+static int LZFindMatch(unsigned char *src, int srcSize, int srcPos, int minDistance, int *chainHeads, int *chainLinks, int *bestBlockDistance)
+{
+	int bestBlockSize = 0;
+	int maxBlockSize = srcSize - srcPos < 18 ? srcSize - srcPos : 18;
+	int blockStart = maxBlockSize >= 3 ? chainHeads[LZHash(&src[srcPos])] : -1;
+
+	while (blockStart >= 0 && srcPos - blockStart <= 0x1000) {
+		int blockDistance = srcPos - blockStart;
+
+		// Only a longer match is any use, so check the byte that would make it longer first.
+		if (blockDistance >= minDistance
+		    && src[blockStart + bestBlockSize] == src[srcPos + bestBlockSize]) {
+			int blockSize = 0;
+
+			while (blockSize < maxBlockSize
+			    && src[blockStart + blockSize] == src[srcPos + blockSize])
+				blockSize++;
+
+			if (blockSize > bestBlockSize) {
+				*bestBlockDistance = blockDistance;
+				bestBlockSize = blockSize;
+
+				if (blockSize == maxBlockSize)
+					break;
+			}
+		}
+
+		blockStart = chainLinks[blockStart];
+	}
+
+	return bestBlockSize;
+}
+
+// Picks the block size to use at every position so that the whole file takes
+// the fewest bits: 9 for a literal and 17 for a block, counting its flag bit.
+// Any length up to the longest match at a position can be used, at the same distance.
+static void LZParseOptimal(unsigned char *src, int srcSize, int minDistance, int *chainHeads, int *chainLinks, int *blockSizes, int *blockDistances)
+{
+	int *costs = malloc((srcSize + 1) * sizeof(int));
+	int hashedPos = 0;
+
+	if (costs == NULL)
+		FATAL_ERROR("Fatal error while compressing LZ file.\n");
+
+	for (int srcPos = 0; srcPos < srcSize; srcPos++) {
+		LZAddToChains(src, srcSize, chainHeads, chainLinks, &hashedPos, srcPos);
+		blockSizes[srcPos] = LZFindMatch(src, srcSize, srcPos, minDistance, chainHeads, chainLinks, &blockDistances[srcPos]);
+	}
+
+	costs[srcSize] = 0;
+
+	for (int srcPos = srcSize - 1; srcPos >= 0; srcPos--) {
+		int longestBlockSize = blockSizes[srcPos];
+
+		costs[srcPos] = 9 + costs[srcPos + 1];
+		blockSizes[srcPos] = 1;
+
+		// On a tie, the longer block means fewer blocks to decode.
+		for (int blockSize = 3; blockSize <= longestBlockSize; blockSize++) {
+			if (17 + costs[srcPos + blockSize] <= costs[srcPos]) {
+				costs[srcPos] = 17 + costs[srcPos + blockSize];
+				blockSizes[srcPos] = blockSize;
+			}
+		}
+	}
+
+	free(costs);
+}
+
+unsigned char *LZCompress(unsigned char *src, int srcSize, int *compressedSize, const int minDistance, const bool optimal)
 {
 	if (srcSize <= 0)
 		goto fail;
@@ -80,10 +201,27 @@ unsigned char *LZCompress(unsigned char *src, int srcSize, int *compressedSize,
 	worstCaseDestSize = (worstCaseDestSize + 3) & ~3;
 
 	unsigned char *dest = malloc(worstCaseDestSize);
+	int *chainHeads = malloc(LZ_HASH_SIZE * sizeof(int));
+	int *chainLinks = malloc(srcSize * sizeof(int));
+	int *blockSizes = NULL;
+	int *blockDistances = NULL;
 
-	if (dest == NULL)
+	if (dest == NULL || chainHeads == NULL || chainLinks == NULL)
 		goto fail;
 
+	for (int i = 0; i < LZ_HASH_SIZE; i++)
+		chainHeads[i] = -1;
+
+	if (optimal) {
+		blockSizes = malloc(srcSize * sizeof(int));
+		blockDistances = malloc(srcSize * sizeof(int));
+
+		if (blockSizes == NULL || blockDistances == NULL)
+			goto fail;
+
+		LZParseOptimal(src, srcSize, minDistance, chainHeads, chainLinks, blockSizes, blockDistances);
+	}
+
 	// header
 	dest[0] = 0x10; // LZ compression type
 	dest[1] = (unsigned char)srcSize;
@@ -92,6 +230,7 @@ unsigned char *LZCompress(unsigned char *src, int srcSize, int *compressedSize,
 
 	int srcPos = 0;
 	int destPos = 4;
+	int hashedPos = 0;
 
 	for (;;) {
 		unsigned char *flags = &dest[destPos++];
@@ -99,27 +238,14 @@ unsigned char *LZCompress(unsigned char *src, int srcSize, int *compressedSize,
 
 		for (int i = 0; i < 8; i++) {
 			int bestBlockDistance = 0;
-			int bestBlockSize = 0;
-			int blockDistance = minDistance;
-
-			while (blockDistance <= srcPos && blockDistance <= 0x1000) {
-				int blockStart = srcPos - blockDistance;
-				int blockSize = 0;
-
-				while (blockSize < 18
-				    && srcPos + blockSize < srcSize
-				    && src[blockStart + blockSize] == src[srcPos + blockSize])
-					blockSize++;
-
-				if (blockSize > bestBlockSize) {
-					bestBlockDistance = blockDistance;
-					bestBlockSize = blockSize;
+			int bestBlockSize;
 
-					if (blockSize == 18)
-						break;
-				}
-
-				blockDistance++;
+			if (optimal) {
+				bestBlockSize = blockSizes[srcPos];
+				bestBlockDistance = blockDistances[srcPos];
+			} else {
+				LZAddToChains(src, srcSize, chainHeads, chainLinks, &hashedPos, srcPos);
+				bestBlockSize = LZFindMatch(src, srcSize, srcPos, minDistance, chainHeads, chainLinks, &bestBlockDistance);
 			}
 
 			if (bestBlockSize >= 3) {
@@ -142,6 +268,10 @@ unsigned char *LZCompress(unsigned char *src, int srcSize, int *compressedSize,
 						dest[destPos++] = 0;
 				}
 
+				free(chainHeads);
+				free(chainLinks);
+				free(blockSizes);
+				free(blockDistances);
 				*compressedSize = destPos;
 				return dest;
 			}
@@ -3,6 +3,12 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
+#include <pthread.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
 #include "global.h"
 #include "util.h"
 #include "options.h"
@@ -13,6 +19,7 @@
 #include "rl.h"
 #include "font.h"
 #include "huff.h"
+#include "cache.h"
 
 struct CommandHandler
 {
@@ -74,21 +81,84 @@ void ConvertGbaToPng(char *inputPath, char *outputPath, struct GbaToPngOptions *
     FreeImage(&image);
 }
 
-void ConvertPngToGba(char *inputPath, char *outputPath, struct PngToGbaOptions *options)
+// The tilemap is LZ-compressed if its path ends in ".lz", e.g. "foo.bin.lz".
+void WriteTilemapFile(char *path, unsigned char *tilemap, int tilemapSize)
+{
+    char *extension = GetFileExtensionAfterDot(path);
+
+    if (extension != NULL && strcmp(extension, "lz") == 0)
+    {
+        int compressedSize;
+        unsigned char *compressedData = LZCompress(tilemap, tilemapSize, &compressedSize, 2, false);
+
+        WriteWholeFile(path, compressedData, compressedSize);
+        free(compressedData);
+    }
+    else
+    {
+        WriteWholeFile(path, tilemap, tilemapSize);
+    }
+}
+
+unsigned char *ConvertPngToGbaData(char *inputPath, struct PngToGbaOptions *options, int *dataSize)
 {
     struct Image image;
+    unsigned char *data;
 
-    image.bitDepth = options->bitDepth;
+    bool generateTilemap = options->tilemapFilePath != NULL;
+
+    if (generateTilemap)
+    {
+        if (!options->isTiled)
+            FATAL_ERROR("\"-tilemap\" can't be used with \"-plain\".\n");
+
+        if (options->numTiles != 0)
+            FATAL_ERROR("\"-tilemap\" can't be used with \"-num_tiles\".\n");
+
+        if (options->isAffineMap && options->bitDepth != 8)
+            FATAL_ERROR("affine maps are necessarily 8bpp\n");
+
+        if (options->bitDepth == 1)
+            FATAL_ERROR("Tilemaps can't be generated for 1bpp images.\n");
+    }
+
+    // Tiles are deduplicated with one byte per pixel, which keeps the palette
+    // number of 4bpp tiles in the upper four bits.
+    image.bitDepth = generateTilemap ? 8 : options->bitDepth;
     image.tilemap.data.affine = NULL; // initialize to NULL to avoid issues in FreeImage
 
     ReadPng(inputPath, &image);
 
-    if (options->isTiled)
-        WriteTileImage(outputPath, options->numTilesMode, options->numTiles, options->metatileWidth, options->metatileHeight, &image, !image.hasPalette);
+    if (generateTilemap)
+    {
+        int tilesSize;
+        int tilemapSize;
+        unsigned char *tilemap;
+        unsigned char *tiles = GetTileImageData(NUM_TILES_IGNORE, 0, options->metatileWidth, options->metatileHeight, &image, !image.hasPalette, &tilesSize);
+
+        data = GenerateTilemap(tiles, tilesSize / 64, options->bitDepth, options->isAffineMap, !image.hasPalette, dataSize, &tilemap, &tilemapSize);
+        WriteTilemapFile(options->tilemapFilePath, tilemap, tilemapSize);
+        free(tiles);
+        free(tilemap);
+    }
+    else if (options->isTiled)
+        data = GetTileImageData(options->numTilesMode, options->numTiles, options->metatileWidth, options->metatileHeight, &image, !image.hasPalette, dataSize);
     else
-        WritePlainImage(outputPath, options->dataWidth, &image, !image.hasPalette);
+        data = GetPlainImageData(options->dataWidth, &image, !image.hasPalette, dataSize);
 
     FreeImage(&image);
+
+    return data;
+}
+
+void ConvertPngToGba(char *inputPath, char *outputPath, struct PngToGbaOptions *options)
+{
+    int dataSize;
+    unsigned char *data = ConvertPngToGbaData(inputPath, options, &dataSize);
+
+    WriteWholeFile(outputPath, data, dataSize);
+
+    free(data);
 }
 
 void HandleGbaToPngCommand(char *inputPath, char *outputPath, int argc, char **argv)
@@ -201,89 +271,114 @@ void HandleGbaToPngCommand(char *inputPath, char *outputPath, int argc, char **a
     ConvertGbaToPng(inputPath, outputPath, &options);
 }
 
-void HandlePngToGbaCommand(char *inputPath, char *outputPath, int argc, char **argv)
+void InitPngToGbaOptions(struct PngToGbaOptions *options, char *outputFileExtension)
 {
-    char *outputFileExtension = GetFileExtensionAfterDot(outputPath);
-    struct PngToGbaOptions options;
-    options.numTilesMode = NUM_TILES_IGNORE;
-    options.numTiles = 0;
-    options.bitDepth = outputFileExtension[0] - '0';
-    options.metatileWidth = 1;
-    options.metatileHeight = 1;
-    options.tilemapFilePath = NULL;
-    options.isAffineMap = false;
-    options.isTiled = true;
-    options.dataWidth = 1;
+    options->numTilesMode = NUM_TILES_IGNORE;
+    options->numTiles = 0;
+    options->bitDepth = outputFileExtension[0] - '0';
+    options->metatileWidth = 1;
+    options->metatileHeight = 1;
+    options->tilemapFilePath = NULL;
+    options->isAffineMap = false;
+    options->isTiled = true;
+    options->dataWidth = 1;
+}
 
-    for (int i = 3; i < argc; i++)
+// Returns false if argv[*i] isn't a PNG to GBA option.
+bool ParsePngToGbaOption(int argc, char **argv, int *i, struct PngToGbaOptions *options)
+{
+    char *option = argv[*i];
+
+    if (strcmp(option, "-num_tiles") == 0)
     {
-        char *option = argv[i];
+        if (*i + 1 >= argc)
+            FATAL_ERROR("No number of tiles following \"-num_tiles\".\n");
 
-        if (strcmp(option, "-num_tiles") == 0)
-        {
-            if (i + 1 >= argc)
-                FATAL_ERROR("No number of tiles following \"-num_tiles\".\n");
+        (*i)++;
 
-            i++;
+        if (!ParseNumber(argv[*i], NULL, 10, &options->numTiles))
+            FATAL_ERROR("Failed to parse number of tiles.\n");
 
-            if (!ParseNumber(argv[i], NULL, 10, &options.numTiles))
-                FATAL_ERROR("Failed to parse number of tiles.\n");
+        if (options->numTiles < 1)
+            FATAL_ERROR("Number of tiles must be positive.\n");
+    }
+    else if (strcmp(option, "-Wnum_tiles") == 0) {
+        options->numTilesMode = NUM_TILES_WARN;
+    }
+    else if (strcmp(option, "-Werror=num_tiles") == 0) {
+        options->numTilesMode = NUM_TILES_ERROR;
+    }
+    else if (strcmp(option, "-mwidth") == 0)
+    {
+        if (*i + 1 >= argc)
+            FATAL_ERROR("No metatile width value following \"-mwidth\".\n");
 
-            if (options.numTiles < 1)
-                FATAL_ERROR("Number of tiles must be positive.\n");
-        }
-        else if (strcmp(option, "-Wnum_tiles") == 0) {
-            options.numTilesMode = NUM_TILES_WARN;
-        }
-        else if (strcmp(option, "-Werror=num_tiles") == 0) {
-            options.numTilesMode = NUM_TILES_ERROR;
-        }
-        else if (strcmp(option, "-mwidth") == 0)
-        {
-            if (i + 1 >= argc)
-                FATAL_ERROR("No metatile width value following \"-mwidth\".\n");
+        (*i)++;
 
-            i++;
+        if (!ParseNumber(argv[*i], NULL, 10, &options->metatileWidth))
+            FATAL_ERROR("Failed to parse metatile width.\n");
 
-            if (!ParseNumber(argv[i], NULL, 10, &options.metatileWidth))
-                FATAL_ERROR("Failed to parse metatile width.\n");
+        if (options->metatileWidth < 1)
+            FATAL_ERROR("metatile width must be positive.\n");
+    }
+    else if (strcmp(option, "-mheight") == 0)
+    {
+        if (*i + 1 >= argc)
+            FATAL_ERROR("No metatile height value following \"-mheight\".\n");
 
-            if (options.metatileWidth < 1)
-                FATAL_ERROR("metatile width must be positive.\n");
-        }
-        else if (strcmp(option, "-mheight") == 0)
-        {
-            if (i + 1 >= argc)
-                FATAL_ERROR("No metatile height value following \"-mheight\".\n");
+        (*i)++;
 
-            i++;
+        if (!ParseNumber(argv[*i], NULL, 10, &options->metatileHeight))
+            FATAL_ERROR("Failed to parse metatile height.\n");
 
-            if (!ParseNumber(argv[i], NULL, 10, &options.metatileHeight))
-                FATAL_ERROR("Failed to parse metatile height.\n");
+        if (options->metatileHeight < 1)
+            FATAL_ERROR("metatile height must be positive.\n");
+    }
+    else if (strcmp(option, "-plain") == 0)
+    {
+        options->isTiled = false;
+    }
+    else if (strcmp(option, "-data_width") == 0)
+    {
+        if (*i + 1 >= argc)
+            FATAL_ERROR("No data width value following \"-data_width\".\n");
+        (*i)++;
 
-            if (options.metatileHeight < 1)
-                FATAL_ERROR("metatile height must be positive.\n");
-        }
-        else if (strcmp(option, "-plain") == 0)
-        {
-            options.isTiled = false;
-        }
-        else if (strcmp(option, "-data_width") == 0)
-        {
-            if (i + 1 >= argc)
-                FATAL_ERROR("No data width value following \"-data_width\".\n");
-            i++;
+        if (!ParseNumber(argv[*i], NULL, 10, &options->dataWidth))
+            FATAL_ERROR("Failed to parse data width.\n");
 
-            if (!ParseNumber(argv[i], NULL, 10, &options.dataWidth))
-                FATAL_ERROR("Failed to parse data width.\n");
+        if (options->dataWidth < 1)
+            FATAL_ERROR("Data width must be positive.\n");
+    }
+    else if (strcmp(option, "-tilemap") == 0)
+    {
+        if (*i + 1 >= argc)
+            FATAL_ERROR("No tilemap file path following \"-tilemap\".\n");
+        (*i)++;
+        options->tilemapFilePath = argv[*i];
+    }
+    else if (strcmp(option, "-affine") == 0)
+    {
+        options->isAffineMap = true;
+    }
+    else
+    {
+        return false;
+    }
 
-            if (options.dataWidth < 1)
-                FATAL_ERROR("Data width must be positive.\n");
-        }
-        else
-        {
-            FATAL_ERROR("Unrecognized option \"%s\".\n", option);
-        }
+    return true;
+}
+
+void HandlePngToGbaCommand(char *inputPath, char *outputPath, int argc, char **argv)
+{
+    struct PngToGbaOptions options;
+
+    InitPngToGbaOptions(&options, GetFileExtensionAfterDot(outputPath));
+
+    for (int i = 3; i < argc; i++)
+    {
+        if (!ParsePngToGbaOption(argc, argv, &i, &options))
+            FATAL_ERROR("Unrecognized option \"%s\".\n", argv[i]);
     }
 
     ConvertPngToGba(inputPath, outputPath, &options);
@@ -313,31 +408,34 @@ void HandleGbaToJascPaletteCommand(char *inputPath, char *outputPath, int argc U
     WriteJascPalette(outputPath, &palette);
 }
 
-void HandleJascToGbaPaletteCommand(char *inputPath, char *outputPath, int argc, char **argv)
+// Returns false if argv[*i] isn't "-num_colors".
+bool ParseNumColorsOption(int argc, char **argv, int *i, int *numColors)
 {
-    int numColors = 0;
+    if (strcmp(argv[*i], "-num_colors") != 0)
+        return false;
 
-    for (int i = 3; i < argc; i++)
-    {
-        char *option = argv[i];
+    if (*i + 1 >= argc)
+        FATAL_ERROR("No number of colors following \"-num_colors\".\n");
 
-        if (strcmp(option, "-num_colors") == 0)
-        {
-            if (i + 1 >= argc)
-                FATAL_ERROR("No number of colors following \"-num_colors\".\n");
+    (*i)++;
 
-            i++;
+    if (!ParseNumber(argv[*i], NULL, 10, numColors))
+        FATAL_ERROR("Failed to parse number of colors.\n");
 
-            if (!ParseNumber(argv[i], NULL, 10, &numColors))
-                FATAL_ERROR("Failed to parse number of colors.\n");
+    if (*numColors < 1)
+        FATAL_ERROR("Number of colors must be positive.\n");
 
-            if (numColors < 1)
-                FATAL_ERROR("Number of colors must be positive.\n");
-        }
-        else
-        {
-            FATAL_ERROR("Unrecognized option \"%s\".\n", option);
-        }
+    return true;
+}
+
+void HandleJascToGbaPaletteCommand(char *inputPath, char *outputPath, int argc, char **argv)
+{
+    int numColors = 0;
+
+    for (int i = 3; i < argc; i++)
+    {
+        if (!ParseNumColorsOption(argc, argv, &i, &numColors))
+            FATAL_ERROR("Unrecognized option \"%s\".\n", argv[i]);
     }
 
     struct Palette palette = {};
@@ -422,62 +520,177 @@ void HandlePngToFullwidthJapaneseFontCommand(char *inputPath, char *outputPath,
     FreeImage(&image);
 }
 
-void HandleLZCompressCommand(char *inputPath, char *outputPath, int argc, char **argv)
+void InitCompressionOptions(struct CompressionOptions *options)
 {
-    int overflowSize = 0;
-    int minDistance = 2; // default, for compatibility with LZ77UnCompVram()
+    options->overflowSize = 0;
+    options->minDistance = 2; // default, for compatibility with LZ77UnCompVram()
+    options->optimal = false;
+    options->huffBitDepth = 4;
+    options->huffMaxCodeLength = 0;
+    options->verify = IsVerifyEnvSet();
+}
 
-    for (int i = 3; i < argc; i++)
+// Returns false if argv[*i] isn't an option for the given kind of compression.
+bool ParseCompressionOption(char *compression, int argc, char **argv, int *i, struct CompressionOptions *options)
+{
+    char *option = argv[*i];
+
+    if (strcmp(compression, "lz") == 0 && strcmp(option, "-overflow") == 0)
     {
-        char *option = argv[i];
+        if (*i + 1 >= argc)
+            FATAL_ERROR("No size following \"-overflow\".\n");
 
-        if (strcmp(option, "-overflow") == 0)
-        {
-            if (i + 1 >= argc)
-                FATAL_ERROR("No size following \"-overflow\".\n");
+        (*i)++;
 
-            i++;
+        if (!ParseNumber(argv[*i], NULL, 10, &options->overflowSize))
+            FATAL_ERROR("Failed to parse overflow size.\n");
 
-            if (!ParseNumber(argv[i], NULL, 10, &overflowSize))
-                FATAL_ERROR("Failed to parse overflow size.\n");
+        if (options->overflowSize < 1)
+            FATAL_ERROR("Overflow size must be positive.\n");
+    }
+    else if (strcmp(compression, "lz") == 0 && strcmp(option, "-search") == 0)
+    {
+        if (*i + 1 >= argc)
+            FATAL_ERROR("No size following \"-search\".\n");
 
-            if (overflowSize < 1)
-                FATAL_ERROR("Overflow size must be positive.\n");
-        }
-        else if (strcmp(option, "-search") == 0)
-        {
-            if (i + 1 >= argc)
-                FATAL_ERROR("No size following \"-search\".\n");
+        (*i)++;
 
-            i++;
+        if (!ParseNumber(argv[*i], NULL, 10, &options->minDistance))
+            FATAL_ERROR("Failed to parse LZ min search distance.\n");
+
+        if (options->minDistance < 1)
+            FATAL_ERROR("LZ min search distance must be positive.\n");
+    }
+    else if (strcmp(compression, "lz") == 0 && strcmp(option, "-optimal") == 0)
+    {
+        // Smaller output, but it won't match the original ROM's data.
+        options->optimal = true;
+    }
+    else if (strcmp(compression, "huff") == 0 && strcmp(option, "-depth") == 0)
+    {
+        if (*i + 1 >= argc)
+            FATAL_ERROR("No size following \"-depth\".\n");
 
-            if (!ParseNumber(argv[i], NULL, 10, &minDistance))
-                FATAL_ERROR("Failed to parse LZ min search distance.\n");
+        (*i)++;
 
-            if (minDistance < 1)
-                FATAL_ERROR("LZ min search distance must be positive.\n");
-        }
-        else
+        if (!ParseNumber(argv[*i], NULL, 10, &options->huffBitDepth))
+            FATAL_ERROR("Failed to parse bit depth.\n");
+
+        if (options->huffBitDepth != 4 && options->huffBitDepth != 8)
+            FATAL_ERROR("GBA only supports bit depth of 4 or 8.\n");
+    }
+    else if (strcmp(option, "-verify") == 0)
+    {
+        options->verify = true;
+    }
+    else if (strcmp(compression, "huff") == 0 && strcmp(option, "-max_code_length") == 0)
+    {
+        if (*i + 1 >= argc)
+            FATAL_ERROR("No length following \"-max_code_length\".\n");
+
+        (*i)++;
+
+        if (!ParseNumber(argv[*i], NULL, 10, &options->huffMaxCodeLength))
+            FATAL_ERROR("Failed to parse max code length.\n");
+
+        if (options->huffMaxCodeLength < 1 || options->huffMaxCodeLength > 32)
+            FATAL_ERROR("Max code length must be between 1 and 32.\n");
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+// Decompresses freshly compressed data and checks that it matches the original.
+void VerifyCompressedData(char *compression, unsigned char *data, int dataSize, unsigned char *compressedData, int compressedSize)
+{
+    int uncompressedSize;
+    unsigned char *uncompressedData;
+
+    if (strcmp(compression, "lz") == 0)
+        uncompressedData = LZDecompress(compressedData, compressedSize, &uncompressedSize);
+    else if (strcmp(compression, "rl") == 0)
+        uncompressedData = RLDecompress(compressedData, compressedSize, &uncompressedSize);
+    else
+        uncompressedData = HuffDecompress(compressedData, compressedSize, &uncompressedSize);
+
+    if (uncompressedSize != dataSize || memcmp(uncompressedData, data, dataSize) != 0)
+        FATAL_ERROR("Verification failed: the %s data doesn't decompress to the original.\n", compression);
+
+    free(uncompressedData);
+}
+
+// Compresses data the way the extension of the compressed file ("lz", "rl" or "huff") says to.
+// Returns NULL if the data can't be compressed that way.
+unsigned char *TryCompressData(char *compression, unsigned char *data, int dataSize, struct CompressionOptions *options, int *compressedSize)
+{
+    unsigned char *compressedData;
+
+    if (strcmp(compression, "lz") == 0)
+    {
+        // The overflow option allows a quirk in some of Ruby/Sapphire's tilesets
+        // to be reproduced. It works by appending a number of zeros to the data
+        // before compressing it and then amending the LZ header's size field to
+        // reflect the expected size. This will cause an overflow when decompressing
+        // the data.
+
+        unsigned char *buffer = data;
+
+        if (options->overflowSize != 0)
         {
-            FATAL_ERROR("Unrecognized option \"%s\".\n", option);
+            buffer = calloc(dataSize + options->overflowSize, 1);
+
+            if (buffer == NULL)
+                FATAL_ERROR("Failed to allocate memory for overflow.\n");
+
+            memcpy(buffer, data, dataSize);
         }
+
+        compressedData = LZCompress(buffer, dataSize + options->overflowSize, compressedSize, options->minDistance, options->optimal);
+
+        compressedData[1] = (unsigned char)dataSize;
+        compressedData[2] = (unsigned char)(dataSize >> 8);
+        compressedData[3] = (unsigned char)(dataSize >> 16);
+
+        if (buffer != data)
+            free(buffer);
     }
+    else if (strcmp(compression, "rl") == 0)
+    {
+        compressedData = RLCompress(data, dataSize, compressedSize);
+    }
+    else
+    {
+        compressedData = HuffCompress(data, dataSize, compressedSize, options->huffBitDepth, options->huffMaxCodeLength);
+    }
+
+    if (compressedData != NULL && options->verify)
+        VerifyCompressedData(compression, data, dataSize, compressedData, *compressedSize);
+
+    return compressedData;
+}
 
-    // The overflow option allows a quirk in some of Ruby/Sapphire's tilesets
-    // to be reproduced. It works by appending a number of zeros to the data
-    // before compressing it and then amending the LZ header's size field to
-    // reflect the expected size. This will cause an overflow when decompressing
-    // the data.
+unsigned char *CompressData(char *compression, unsigned char *data, int dataSize, struct CompressionOptions *options, int *compressedSize)
+{
+    unsigned char *compressedData = TryCompressData(compression, data, dataSize, options, compressedSize);
+
+    // Only Huffman compression can fail.
+    if (compressedData == NULL)
+        FATAL_ERROR("Fatal error while compressing Huff file: unable to encode binary tree.\n");
+
+    return compressedData;
+}
 
+void CompressFile(char *inputPath, char *outputPath, char *compression, struct CompressionOptions *options)
+{
     int fileSize;
-    unsigned char *buffer = ReadWholeFileZeroPadded(inputPath, &fileSize, overflowSize);
+    unsigned char *buffer = ReadWholeFile(inputPath, &fileSize);
 
     int compressedSize;
-    unsigned char *compressedData = LZCompress(buffer, fileSize + overflowSize, &compressedSize, minDistance);
-
-    compressedData[1] = (unsigned char)fileSize;
-    compressedData[2] = (unsigned char)(fileSize >> 8);
-    compressedData[3] = (unsigned char)(fileSize >> 16);
+    unsigned char *compressedData = CompressData(compression, buffer, fileSize, options, &compressedSize);
 
     free(buffer);
 
@@ -486,6 +699,21 @@ void HandleLZCompressCommand(char *inputPath, char *outputPath, int argc, char *
     free(compressedData);
 }
 
+void HandleLZCompressCommand(char *inputPath, char *outputPath, int argc, char **argv)
+{
+    struct CompressionOptions options;
+
+    InitCompressionOptions(&options);
+
+    for (int i = 3; i < argc; i++)
+    {
+        if (!ParseCompressionOption("lz", argc, argv, &i, &options))
+            FATAL_ERROR("Unrecognized option \"%s\".\n", argv[i]);
+    }
+
+    CompressFile(inputPath, outputPath, "lz", &options);
+}
+
 void HandleLZDecompressCommand(char *inputPath, char *outputPath, int argc UNUSED, char **argv UNUSED)
 {
     int fileSize;
@@ -501,19 +729,19 @@ void HandleLZDecompressCommand(char *inputPath, char *outputPath, int argc UNUSE
     free(uncompressedData);
 }
 
-void HandleRLCompressCommand(char *inputPath, char *outputPath, int argc UNUSED, char **argv UNUSED)
+void HandleRLCompressCommand(char *inputPath, char *outputPath, int argc, char **argv)
 {
-    int fileSize;
-    unsigned char *buffer = ReadWholeFile(inputPath, &fileSize);
-
-    int compressedSize;
-    unsigned char *compressedData = RLCompress(buffer, fileSize, &compressedSize);
+    struct CompressionOptions options;
 
-    free(buffer);
+    InitCompressionOptions(&options);
 
-    WriteWholeFile(outputPath, compressedData, compressedSize);
+    for (int i = 3; i < argc; i++)
+    {
+        if (!ParseCompressionOption("rl", argc, argv, &i, &options))
+            FATAL_ERROR("Unrecognized option \"%s\".\n", argv[i]);
+    }
 
-    free(compressedData);
+    CompressFile(inputPath, outputPath, "rl", &options);
 }
 
 void HandleRLDecompressCommand(char *inputPath, char *outputPath, int argc UNUSED, char **argv UNUSED)
@@ -533,42 +761,17 @@ void HandleRLDecompressCommand(char *inputPath, char *outputPath, int argc UNUSE
 
 void HandleHuffCompressCommand(char *inputPath, char *outputPath, int argc, char **argv)
 {
-    int fileSize;
-    int bitDepth = 4;
+    struct CompressionOptions options;
+
+    InitCompressionOptions(&options);
 
     for (int i = 3; i < argc; i++)
     {
-        char *option = argv[i];
-
-        if (strcmp(option, "-depth") == 0)
-        {
-            if (i + 1 >= argc)
-                FATAL_ERROR("No size following \"-depth\".\n");
-
-            i++;
-
-            if (!ParseNumber(argv[i], NULL, 10, &bitDepth))
-                FATAL_ERROR("Failed to parse bit depth.\n");
-
-            if (bitDepth != 4 && bitDepth != 8)
-                FATAL_ERROR("GBA only supports bit depth of 4 or 8.\n");
-        }
-        else
-        {
-            FATAL_ERROR("Unrecognized option \"%s\".\n", option);
-        }
+        if (!ParseCompressionOption("huff", argc, argv, &i, &options))
+            FATAL_ERROR("Unrecognized option \"%s\".\n", argv[i]);
     }
 
-    unsigned char *buffer = ReadWholeFile(inputPath, &fileSize);
-
-    int compressedSize;
-    unsigned char *compressedData = HuffCompress(buffer, fileSize, &compressedSize, bitDepth);
-
-    free(buffer);
-
-    WriteWholeFile(outputPath, compressedData, compressedSize);
-
-    free(compressedData);
+    CompressFile(inputPath, outputPath, "huff", &options);
 }
 
 void HandleHuffDecompressCommand(char *inputPath, char *outputPath, int argc UNUSED, char **argv UNUSED)
@@ -586,15 +789,123 @@ void HandleHuffDecompressCommand(char *inputPath, char *outputPath, int argc UNU
     free(uncompressedData);
 }
 
-int main(int argc, char **argv)
+// Returns the path of the file that would be compressed to make outputPath, e.g.
+// "foo.4bpp" for "foo.4bpp.lz".
+char *GetIntermediatePath(char *outputPath)
 {
-    char converted = 0;
+    size_t length = GetFileExtension(outputPath) - outputPath;
+    char *intermediatePath = malloc(length + 1);
 
-    if (argc < 3)
-        FATAL_ERROR("Usage: gbagfx INPUT_PATH OUTPUT_PATH [options...]\n");
+    if (intermediatePath == NULL)
+        FATAL_ERROR("Failed to allocate memory for intermediate path.\n");
 
-    struct CommandHandler handlers[] =
-    {
+    memcpy(intermediatePath, outputPath, length);
+    intermediatePath[length] = 0;
+
+    return intermediatePath;
+}
+
+// Returns whether outputPath is a compressed file, like "foo.4bpp.lz", that inputPath
+// has to be converted to something else for before compressing it.
+bool IsConvertAndCompress(char *inputFileExtension, char *outputPath)
+{
+    char *compression = GetFileExtensionAfterDot(outputPath);
+
+    if (compression == NULL
+        || (strcmp(compression, "lz") != 0 && strcmp(compression, "rl") != 0 && strcmp(compression, "huff") != 0))
+        return false;
+
+    char *intermediatePath = GetIntermediatePath(outputPath);
+    char *intermediateFileExtension = GetFileExtensionAfterDot(intermediatePath);
+    bool result = false;
+
+    if (intermediateFileExtension == NULL)
+        result = false;
+    else if (strcmp(inputFileExtension, "png") == 0)
+        result = strcmp(intermediateFileExtension, "1bpp") == 0
+              || strcmp(intermediateFileExtension, "4bpp") == 0
+              || strcmp(intermediateFileExtension, "8bpp") == 0
+              || strcmp(intermediateFileExtension, "gbapal") == 0;
+    else if (strcmp(inputFileExtension, "pal") == 0)
+        result = strcmp(intermediateFileExtension, "gbapal") == 0;
+
+    free(intermediatePath);
+
+    return result;
+}
+
+// Converts and compresses in memory, e.g. "foo.png" straight to "foo.4bpp.lz".
+// Takes the options of both steps. With -intermediate, "foo.4bpp" is written too.
+void HandleConvertAndCompressCommand(char *inputPath, char *outputPath, int argc, char **argv)
+{
+    char *compression = GetFileExtensionAfterDot(outputPath);
+    char *intermediatePath = GetIntermediatePath(outputPath);
+    char *inputFileExtension = GetFileExtensionAfterDot(inputPath);
+    char *intermediateFileExtension = GetFileExtensionAfterDot(intermediatePath);
+    bool isPalette = strcmp(intermediateFileExtension, "gbapal") == 0;
+    bool writeIntermediate = false;
+    int numColors = 0;
+    struct PngToGbaOptions pngOptions;
+    struct CompressionOptions compressionOptions;
+
+    if (!isPalette)
+        InitPngToGbaOptions(&pngOptions, intermediateFileExtension);
+
+    InitCompressionOptions(&compressionOptions);
+
+    for (int i = 3; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-intermediate") == 0)
+            writeIntermediate = true;
+        else if (!ParseCompressionOption(compression, argc, argv, &i, &compressionOptions)
+                 && !(isPalette ? ParseNumColorsOption(argc, argv, &i, &numColors) : ParsePngToGbaOption(argc, argv, &i, &pngOptions)))
+            FATAL_ERROR("Unrecognized option \"%s\".\n", argv[i]);
+    }
+
+    int dataSize;
+    unsigned char *data;
+
+    if (isPalette)
+    {
+        struct Palette palette = {};
+
+        if (strcmp(inputFileExtension, "png") == 0)
+            ReadPngPalette(inputPath, &palette);
+        else
+            ReadJascPalette(inputPath, &palette);
+
+        if (numColors != 0)
+            palette.numColors = numColors;
+
+        data = GetGbaPaletteData(&palette, &dataSize);
+    }
+    else
+    {
+        data = ConvertPngToGbaData(inputPath, &pngOptions, &dataSize);
+    }
+
+    if (writeIntermediate)
+        WriteWholeFile(intermediatePath, data, dataSize);
+
+    int compressedSize;
+    unsigned char *compressedData = CompressData(compression, data, dataSize, &compressionOptions, &compressedSize);
+
+    free(data);
+
+    WriteWholeFile(outputPath, compressedData, compressedSize);
+
+    free(compressedData);
+    free(intermediatePath);
+}
+
+// Runs one conversion. argv is laid out like the command line: the input path,
+// the output path, then options, starting at argv[1].
+void ConvertFile(int argc, char **argv)
+{
+    char converted = 0;
+
+    struct CommandHandler handlers[] =
+    {
         { "1bpp", "png", HandleGbaToPngCommand },
         { "4bpp", "png", HandleGbaToPngCommand },
         { "8bpp", "png", HandleGbaToPngCommand },
@@ -656,7 +967,28 @@ int main(int argc, char **argv)
         }
     }
 
-    for (int i = 0; handlers[i].function != NULL; i++)
+    char *cacheDir = GetCacheDir();
+    bool useCache = cacheDir != NULL && IsCacheable(argc, argv);
+    uint64_t cacheKey = 0;
+    bool fromCache = false;
+
+    if (useCache)
+    {
+        cacheKey = GetCacheKey(inputPath, outputPath, argc, argv);
+        fromCache = RestoreFromCache(cacheDir, cacheKey, outputPath);
+        converted = fromCache;
+
+        if (!fromCache)
+            BeginCapturingWarnings();
+    }
+
+    if (!converted && IsConvertAndCompress(inputFileExtension, outputPath))
+    {
+        HandleConvertAndCompressCommand(inputPath, outputPath, argc, argv);
+        converted = 1;
+    }
+
+    for (int i = 0; !converted && handlers[i].function != NULL; i++)
     {
         if ((handlers[i].inputFileExtension == NULL || strcmp(handlers[i].inputFileExtension, inputFileExtension) == 0)
             && (handlers[i].outputFileExtension == NULL || strcmp(handlers[i].outputFileExtension, outputFileExtension) == 0))
@@ -667,11 +999,573 @@ int main(int argc, char **argv)
         }
     }
 
+    if (useCache && !fromCache)
+    {
+        size_t warningsSize;
+        char *warnings = EndCapturingWarnings(&warningsSize);
+
+        if (converted)
+            StoreInCache(cacheDir, cacheKey, outputPath, warnings, warningsSize);
+
+        free(warnings);
+    }
+
     if (outputPath != argv[2])
         free(outputPath);
 
     if (!converted)
         FATAL_ERROR("Don't know how to convert \"%s\" to \"%s\".\n", argv[1], argv[2]);
+}
+
+struct BatchJob
+{
+    int argc;
+    char **argv;
+};
+
+struct Batch
+{
+    struct BatchJob *jobs;
+    int jobCount;
+    int nextJob;
+    pthread_mutex_t mutex;
+};
+
+// Reads a manifest with one conversion per line, written the way it would be on
+// the command line: INPUT_PATH OUTPUT_PATH [options...]. Blank lines and lines
+// starting with '#' are skipped. Paths can't contain spaces.
+struct BatchJob *ReadManifest(char *path, char **text, int *jobCount)
+{
+    FILE *fp = fopen(path, "rb");
+
+    if (fp == NULL)
+        FATAL_ERROR("Failed to open \"%s\" for reading.\n", path);
+
+    fseek(fp, 0, SEEK_END);
+
+    long size = ftell(fp);
+
+    *text = malloc(size + 1);
+
+    if (*text == NULL)
+        FATAL_ERROR("Failed to allocate memory for reading \"%s\".\n", path);
+
+    rewind(fp);
+
+    if (size != 0 && fread(*text, size, 1, fp) != 1)
+        FATAL_ERROR("Failed to read \"%s\".\n", path);
+
+    fclose(fp);
+
+    (*text)[size] = 0;
+
+    int capacity = 64;
+    struct BatchJob *jobs = malloc(capacity * sizeof(struct BatchJob));
+    char *line = *text;
+    int lineNum = 0;
+
+    if (jobs == NULL)
+        FATAL_ERROR("Failed to allocate memory for batch jobs.\n");
+
+    *jobCount = 0;
+
+    while (*line != 0)
+    {
+        char *end = line + strcspn(line, "\n");
+        char *next = *end != 0 ? end + 1 : end;
+
+        *end = 0;
+        lineNum++;
+
+        // Each job's argv starts with the program name, like main's.
+        int argCapacity = 8;
+        int argc = 1;
+        char **argv = malloc(argCapacity * sizeof(char *));
+
+        if (argv == NULL)
+            FATAL_ERROR("Failed to allocate memory for batch jobs.\n");
+
+        argv[0] = "gbagfx";
+
+        for (char *arg = strtok(line, " \t\r"); arg != NULL && arg[0] != '#'; arg = strtok(NULL, " \t\r"))
+        {
+            if (argc + 1 >= argCapacity)
+            {
+                argCapacity *= 2;
+                argv = realloc(argv, argCapacity * sizeof(char *));
+
+                if (argv == NULL)
+                    FATAL_ERROR("Failed to allocate memory for batch jobs.\n");
+            }
+
+            argv[argc++] = arg;
+        }
+
+        argv[argc] = NULL;
+
+        if (argc == 1)
+        {
+            free(argv);
+        }
+        else if (argc < 3)
+        {
+            FATAL_ERROR("%s:%d: Expected INPUT_PATH OUTPUT_PATH [options...]\n", path, lineNum);
+        }
+        else
+        {
+            if (*jobCount == capacity)
+            {
+                capacity *= 2;
+                jobs = realloc(jobs, capacity * sizeof(struct BatchJob));
+
+                if (jobs == NULL)
+                    FATAL_ERROR("Failed to allocate memory for batch jobs.\n");
+            }
+
+            jobs[*jobCount].argc = argc;
+            jobs[*jobCount].argv = argv;
+            (*jobCount)++;
+        }
+
+        line = next;
+    }
+
+    return jobs;
+}
+
+void *RunBatchJobs(void *arg)
+{
+    struct Batch *batch = arg;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&batch->mutex);
+        int job = batch->nextJob++;
+        pthread_mutex_unlock(&batch->mutex);
+
+        if (job >= batch->jobCount)
+            return NULL;
+
+        ConvertFile(batch->jobs[job].argc, batch->jobs[job].argv);
+    }
+}
+
+int GetDefaultJobCount(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? count : 1;
+#endif
+}
+
+// Runs every conversion in a manifest on a pool of threads. Since they run in
+// no particular order, no job can use another job's output.
+void HandleBatch(int argc, char **argv)
+{
+    char *manifestPath = argv[2];
+    int jobCount = GetDefaultJobCount();
+
+    for (int i = 3; i < argc; i++)
+    {
+        char *option = argv[i];
+
+        if (strcmp(option, "-jobs") == 0)
+        {
+            if (i + 1 >= argc)
+                FATAL_ERROR("No number of jobs following \"-jobs\".\n");
+
+            i++;
+
+            if (!ParseNumber(argv[i], NULL, 10, &jobCount))
+                FATAL_ERROR("Failed to parse number of jobs.\n");
+
+            if (jobCount < 1)
+                FATAL_ERROR("Number of jobs must be positive.\n");
+        }
+        else
+        {
+            FATAL_ERROR("Unrecognized option \"%s\".\n", option);
+        }
+    }
+
+    struct Batch batch;
+    char *manifestText;
+
+    batch.jobs = ReadManifest(manifestPath, &manifestText, &batch.jobCount);
+    batch.nextJob = 0;
+    pthread_mutex_init(&batch.mutex, NULL);
+
+    if (jobCount > batch.jobCount)
+        jobCount = batch.jobCount;
+
+    pthread_t *threads = malloc(jobCount * sizeof(pthread_t));
+
+    if (jobCount > 0 && threads == NULL)
+        FATAL_ERROR("Failed to allocate memory for threads.\n");
+
+    // The main thread is one of the workers.
+    for (int i = 1; i < jobCount; i++)
+    {
+        if (pthread_create(&threads[i], NULL, RunBatchJobs, &batch) != 0)
+            FATAL_ERROR("Failed to start a thread.\n");
+    }
+
+    RunBatchJobs(&batch);
+
+    for (int i = 1; i < jobCount; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&batch.mutex);
+
+    for (int i = 0; i < batch.jobCount; i++)
+        free(batch.jobs[i].argv);
+
+    free(batch.jobs);
+    free(manifestText);
+    free(threads);
+}
+
+// Rough cycle counts for the BIOS's WRAM decompressors reading from ROM. They're
+// only meant for comparing formats with each other, not for timing a frame.
+#define BIOS_CALL_CYCLES 60
+#define COPY_CYCLES_PER_WORD 8
+#define LZ_CYCLES_PER_FLAGS 12
+#define LZ_CYCLES_PER_LITERAL 14
+#define LZ_CYCLES_PER_BLOCK 30
+#define LZ_CYCLES_PER_BLOCK_BYTE 10
+#define RL_CYCLES_PER_RUN 24
+#define RL_CYCLES_PER_LITERAL 12
+#define RL_CYCLES_PER_RUN_BYTE 8
+#define HUFF_CYCLES_PER_BIT 14
+#define HUFF_CYCLES_PER_VALUE 10
+
+struct CompressionCandidate
+{
+    const char *name;
+    char *compression; // NULL to leave the data uncompressed
+    int huffBitDepth;
+    struct CompressionOptions options;
+    unsigned char *data;
+    int dataSize;
+    unsigned char *compressedData; // NULL if the data can't be compressed this way
+    int compressedSize;
+    long decodeCycles;
+};
+
+long EstimateLZDecodeCycles(unsigned char *src, int srcSize)
+{
+    int destSize = src[1] | (src[2] << 8) | (src[3] << 16);
+    int srcPos = 4;
+    int destPos = 0;
+    long cycles = BIOS_CALL_CYCLES;
+
+    while (destPos < destSize && srcPos < srcSize)
+    {
+        unsigned char flags = src[srcPos++];
+
+        cycles += LZ_CYCLES_PER_FLAGS;
+
+        for (int i = 0; i < 8 && destPos < destSize && srcPos < srcSize; i++)
+        {
+            if (flags & 0x80)
+            {
+                int blockSize = (src[srcPos] >> 4) + 3;
+
+                srcPos += 2;
+                destPos += blockSize;
+                cycles += LZ_CYCLES_PER_BLOCK + (long)LZ_CYCLES_PER_BLOCK_BYTE * blockSize;
+            }
+            else
+            {
+                srcPos++;
+                destPos++;
+                cycles += LZ_CYCLES_PER_LITERAL;
+            }
+
+            flags <<= 1;
+        }
+    }
+
+    return cycles;
+}
+
+long EstimateRLDecodeCycles(unsigned char *src, int srcSize)
+{
+    int destSize = src[1] | (src[2] << 8) | (src[3] << 16);
+    int srcPos = 4;
+    int destPos = 0;
+    long cycles = BIOS_CALL_CYCLES;
+
+    while (destPos < destSize && srcPos < srcSize)
+    {
+        unsigned char flag = src[srcPos++];
+
+        cycles += RL_CYCLES_PER_RUN;
+
+        if (flag & 0x80)
+        {
+            int runSize = (flag & 0x7F) + 3;
+
+            srcPos++;
+            destPos += runSize;
+            cycles += (long)RL_CYCLES_PER_RUN_BYTE * runSize;
+        }
+        else
+        {
+            int literalSize = (flag & 0x7F) + 1;
+
+            srcPos += literalSize;
+            destPos += literalSize;
+            cycles += (long)RL_CYCLES_PER_LITERAL * literalSize;
+        }
+    }
+
+    return cycles;
+}
+
+// The BIOS walks the tree a bit at a time, so the time goes with the number of
+// bits and values rather than the shape of the tree.
+long EstimateHuffDecodeCycles(unsigned char *src, int srcSize)
+{
+    int bitDepth = src[0] & 15;
+    long destSize = src[1] | (src[2] << 8) | (src[3] << 16);
+    long numBits = (srcSize - 4 - (src[4] + 1) * 2) * 8L;
+
+    return BIOS_CALL_CYCLES + HUFF_CYCLES_PER_BIT * numBits + HUFF_CYCLES_PER_VALUE * (destSize * 8 / bitDepth);
+}
+
+void *CompressCandidate(void *arg)
+{
+    struct CompressionCandidate *candidate = arg;
+
+    if (candidate->compression == NULL)
+    {
+        // Copied with CpuFastSet instead.
+        candidate->compressedData = candidate->data;
+        candidate->compressedSize = candidate->dataSize;
+        candidate->decodeCycles = BIOS_CALL_CYCLES + COPY_CYCLES_PER_WORD * ((candidate->dataSize + 3L) / 4);
+        return NULL;
+    }
+
+    candidate->options.huffBitDepth = candidate->huffBitDepth;
+    candidate->compressedData = TryCompressData(candidate->compression, candidate->data, candidate->dataSize,
+                                                &candidate->options, &candidate->compressedSize);
+
+    if (candidate->compressedData == NULL)
+        return NULL;
+
+    if (strcmp(candidate->compression, "lz") == 0)
+        candidate->decodeCycles = EstimateLZDecodeCycles(candidate->compressedData, candidate->compressedSize);
+    else if (strcmp(candidate->compression, "rl") == 0)
+        candidate->decodeCycles = EstimateRLDecodeCycles(candidate->compressedData, candidate->compressedSize);
+    else
+        candidate->decodeCycles = EstimateHuffDecodeCycles(candidate->compressedData, candidate->compressedSize);
+
+    return NULL;
+}
+
+// Writes a manifest line for -batch that recreates the chosen file, after
+// comments with the results for every format.
+void WriteBestManifest(char *path, char *inputPath, char *outputPath, struct CompressionCandidate *candidates,
+                       int numCandidates, struct CompressionCandidate *best)
+{
+    FILE *fp = fopen(path, "w");
+
+    if (fp == NULL)
+        FATAL_ERROR("Failed to open \"%s\" for writing.\n", path);
+
+    for (int i = 0; i < numCandidates; i++)
+    {
+        if (candidates[i].compressedData != NULL)
+            fprintf(fp, "# %s: %d bytes, ~%ld cycles\n", candidates[i].name, candidates[i].compressedSize, candidates[i].decodeCycles);
+        else
+            fprintf(fp, "# %s: can't be encoded\n", candidates[i].name);
+    }
+
+    if (best->compression == NULL)
+    {
+        fprintf(fp, "# Best left uncompressed: %s\n", inputPath);
+    }
+    else
+    {
+        struct CompressionOptions *options = &best->options;
+
+        fprintf(fp, "%s %s", inputPath, outputPath);
+
+        if (strcmp(best->compression, "lz") == 0)
+        {
+            if (options->overflowSize != 0)
+                fprintf(fp, " -overflow %d", options->overflowSize);
+            if (options->minDistance != 2)
+                fprintf(fp, " -search %d", options->minDistance);
+            if (options->optimal)
+                fprintf(fp, " -optimal");
+        }
+        else if (strcmp(best->compression, "huff") == 0)
+        {
+            fprintf(fp, " -depth %d", best->huffBitDepth);
+            if (options->huffMaxCodeLength != 0)
+                fprintf(fp, " -max_code_length %d", options->huffMaxCodeLength);
+        }
+
+        fprintf(fp, "\n");
+    }
+
+    fclose(fp);
+}
+
+// Compresses a file in every format the BIOS can decompress, each on its own
+// thread, and reports the sizes and estimated decode times. The best is the
+// smallest, or with "-by cycles" the fastest to decode. With -write, it's
+// written next to the input, e.g. "foo.4bpp.lz" for "foo.4bpp", along with a
+// "foo.4bpp.best" manifest for -batch that recreates it.
+void HandleCompressBest(int argc, char **argv)
+{
+    char *inputPath = argv[2];
+    bool write = false;
+    bool byCycles = false;
+    struct CompressionOptions options;
+
+    InitCompressionOptions(&options);
+
+    // Every result is checked, since a smaller file that doesn't decompress
+    // properly is no use.
+    options.verify = true;
+
+    for (int i = 3; i < argc; i++)
+    {
+        char *option = argv[i];
+
+        if (strcmp(option, "-write") == 0)
+        {
+            write = true;
+        }
+        else if (strcmp(option, "-by") == 0)
+        {
+            if (i + 1 >= argc)
+                FATAL_ERROR("No criterion following \"-by\".\n");
+
+            i++;
+
+            if (strcmp(argv[i], "cycles") == 0)
+                byCycles = true;
+            else if (strcmp(argv[i], "size") == 0)
+                byCycles = false;
+            else
+                FATAL_ERROR("Criterion must be \"size\" or \"cycles\".\n");
+        }
+        else if (strcmp(option, "-depth") == 0
+                 || (!ParseCompressionOption("lz", argc, argv, &i, &options)
+                     && !ParseCompressionOption("huff", argc, argv, &i, &options)))
+        {
+            FATAL_ERROR("Unrecognized option \"%s\".\n", option);
+        }
+    }
+
+    int dataSize;
+    unsigned char *data = ReadWholeFile(inputPath, &dataSize);
+
+    struct CompressionCandidate candidates[] =
+    {
+        { .name = "lz", .compression = "lz" },
+        { .name = "rl", .compression = "rl" },
+        { .name = "huff4", .compression = "huff", .huffBitDepth = 4 },
+        { .name = "huff8", .compression = "huff", .huffBitDepth = 8 },
+        { .name = "none", .compression = NULL },
+    };
+    int numCandidates = sizeof(candidates) / sizeof(candidates[0]);
+    pthread_t threads[sizeof(candidates) / sizeof(candidates[0])];
+
+    for (int i = 0; i < numCandidates; i++)
+    {
+        candidates[i].options = options;
+        candidates[i].data = data;
+        candidates[i].dataSize = dataSize;
+    }
+
+    // The main thread takes the last one.
+    for (int i = 0; i < numCandidates - 1; i++)
+    {
+        if (pthread_create(&threads[i], NULL, CompressCandidate, &candidates[i]) != 0)
+            FATAL_ERROR("Failed to start a thread.\n");
+    }
+
+    CompressCandidate(&candidates[numCandidates - 1]);
+
+    for (int i = 0; i < numCandidates - 1; i++)
+        pthread_join(threads[i], NULL);
+
+    struct CompressionCandidate *best = NULL;
+
+    printf("%s: %d bytes\n", inputPath, dataSize);
+
+    for (int i = 0; i < numCandidates; i++)
+    {
+        struct CompressionCandidate *candidate = &candidates[i];
+
+        if (candidate->compressedData == NULL)
+        {
+            printf("  %-6s can't be encoded\n", candidate->name);
+            continue;
+        }
+
+        printf("  %-6s %8d bytes %10ld cycles\n", candidate->name, candidate->compressedSize, candidate->decodeCycles);
+
+        if (best == NULL
+            || (byCycles ? candidate->decodeCycles < best->decodeCycles : candidate->compressedSize < best->compressedSize))
+            best = candidate;
+    }
+
+    printf("  best: %s\n", best->name);
+
+    if (write)
+    {
+        char *compression = best->compression != NULL ? best->compression : "";
+        size_t pathSize = strlen(inputPath) + 6;
+        char *outputPath = malloc(pathSize);
+        char *manifestPath = malloc(pathSize);
+
+        if (outputPath == NULL || manifestPath == NULL)
+            FATAL_ERROR("Failed to allocate memory for output path.\n");
+
+        snprintf(outputPath, pathSize, "%s.%s", inputPath, compression);
+        snprintf(manifestPath, pathSize, "%s.best", inputPath);
+
+        if (best->compression != NULL)
+            WriteWholeFile(outputPath, best->compressedData, best->compressedSize);
+
+        WriteBestManifest(manifestPath, inputPath, outputPath, candidates, numCandidates, best);
+
+        free(outputPath);
+        free(manifestPath);
+    }
+
+    for (int i = 0; i < numCandidates; i++)
+    {
+        if (candidates[i].compressedData != data)
+            free(candidates[i].compressedData);
+    }
+
+    free(data);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+        FATAL_ERROR("Usage: gbagfx INPUT_PATH OUTPUT_PATH [options...]\n"
+                    "       gbagfx -batch MANIFEST_PATH [-jobs N]\n"
+                    "       gbagfx -compress_best INPUT_PATH [-write] [-by size|cycles] [options...]\n");
+
+    if (strcmp(argv[1], "-batch") == 0)
+        HandleBatch(argc, argv);
+    else if (strcmp(argv[1], "-compress_best") == 0)
+        HandleCompressBest(argc, argv);
+    else
+        ConvertFile(argc, argv);
 
     return 0;
 }
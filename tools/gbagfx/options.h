@@ -31,4 +31,13 @@ struct PngToGbaOptions {
     int dataWidth;
 };
 
+struct CompressionOptions {
+    int overflowSize;
+    int minDistance;
+    bool optimal;
+    int huffBitDepth;
+    int huffMaxCodeLength;
+    bool verify;
+};
+
 #endif // OPTIONS_H
@@ -2,6 +2,7 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include "global.h"
 #include "rl.h"
 
@@ -31,23 +32,28 @@ unsigned char *RLDecompress(unsigned char *src, int srcSize, int *uncompressedSi
         if (compressed)
         {
             int length = (flags & 0x7F) + 3;
+
+            if (srcPos >= srcSize)
+                goto fail;
+
             unsigned char data = src[srcPos++];
 
             if (destPos + length > destSize)
                 goto fail;
 
-            for (int i = 0; i < length; i++)
-                dest[destPos++] = data;
+            memset(&dest[destPos], data, length);
+            destPos += length;
         }
         else
         {
             int length = (flags & 0x7F) + 1;
 
-            if (destPos + length > destSize)
+            if (destPos + length > destSize || srcPos + length > srcSize)
                 goto fail;
 
-            for (int i = 0; i < length; i++)
-                dest[destPos++] = src[srcPos++];
+            memcpy(&dest[destPos], &src[srcPos], length);
+            destPos += length;
+            srcPos += length;
         }
 
         if (destPos == destSize)
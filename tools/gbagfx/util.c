@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <limits.h>
 #include "global.h"
@@ -129,3 +130,68 @@ void WriteWholeFile(char *path, void *buffer, int bufferSize)
 
 	fclose(fp);
 }
+
+// Warnings printed by the current thread since BeginCapturingWarnings, so that
+// a cached conversion can repeat them.
+static _Thread_local bool sIsCapturingWarnings;
+static _Thread_local char *sWarnings;
+static _Thread_local size_t sWarningsSize;
+
+void Warn(const char *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+
+	if (!sIsCapturingWarnings)
+		return;
+
+	va_start(args, format);
+	int length = vsnprintf(NULL, 0, format, args);
+	va_end(args);
+
+	if (length <= 0)
+		return;
+
+	sWarnings = realloc(sWarnings, sWarningsSize + length + 1);
+
+	if (sWarnings == NULL)
+		FATAL_ERROR("Failed to allocate memory for warnings.\n");
+
+	va_start(args, format);
+	vsnprintf(sWarnings + sWarningsSize, length + 1, format, args);
+	va_end(args);
+
+	sWarningsSize += length;
+}
+
+void BeginCapturingWarnings(void)
+{
+	sIsCapturingWarnings = true;
+	sWarnings = NULL;
+	sWarningsSize = 0;
+}
+
+// Returns the captured warnings, which the caller frees. They aren't
+// null-terminated, and are NULL if there weren't any.
+char *EndCapturingWarnings(size_t *size)
+{
+	char *warnings = sWarnings;
+
+	*size = sWarningsSize;
+	sIsCapturingWarnings = false;
+	sWarnings = NULL;
+	sWarningsSize = 0;
+
+	return warnings;
+}
+
+// GBAGFX_VERIFY turns on -verify for every compression, e.g. in CI.
+bool IsVerifyEnvSet(void)
+{
+	char *verify = getenv("GBAGFX_VERIFY");
+
+	return verify != NULL && *verify != 0 && strcmp(verify, "0") != 0;
+}
@@ -4,6 +4,7 @@
 #define UTIL_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
 bool ParseNumber(char *s, char **end, int radix, int *intValue);
 char *GetFileExtension(char *path);
@@ -11,5 +12,9 @@ char *GetFileExtensionAfterDot(char *path);
 unsigned char *ReadWholeFile(char *path, int *size);
 unsigned char *ReadWholeFileZeroPadded(char *path, int *size, int padAmount);
 void WriteWholeFile(char *path, void *buffer, int bufferSize);
+void Warn(const char *format, ...);
+void BeginCapturingWarnings(void);
+char *EndCapturingWarnings(size_t *size);
+bool IsVerifyEnvSet(void);
 
 #endif // UTIL_H
@@ -0,0 +1,173 @@
+// Copyright(c) 2016 YamaArashi
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#include <cstdio>
+#include <cstring>
+#include "preproc.h"
+#include "asm_cache.h"
+#include "file_util.h"
+#include "hash.h"
+
+// A fragment is this magic and its 64-bit key, followed by records that are
+// each a type byte, a 32-bit length and that many bytes. The key covers
+// preproc's version, so the magic only needs to change with the layout.
+static const char kFragmentMagic[8] = { 'P', 'P', 'A', 'S', 'M', 0, 0, 2 };
+
+static const std::size_t kFragmentHeaderSize = sizeof(kFragmentMagic) + sizeof(std::uint64_t);
+
+bool AsmFragment::Open(const std::string& path, std::uint64_t key)
+{
+    m_records.clear();
+
+    if (!m_file.Open(path))
+        return false;
+
+    const char* data = m_file.Data();
+    std::size_t size = m_file.Size();
+
+    if (size < kFragmentHeaderSize || std::memcmp(data, kFragmentMagic, sizeof(kFragmentMagic)) != 0
+     || std::memcmp(data + sizeof(kFragmentMagic), &key, sizeof(key)) != 0)
+        return false;
+
+    std::size_t pos = kFragmentHeaderSize;
+
+    while (pos < size)
+    {
+        std::uint32_t length;
+
+        if (size - pos < 1 + sizeof(length))
+            return false;
+
+        unsigned char type = data[pos];
+        std::memcpy(&length, data + pos + 1, sizeof(length));
+        pos += 1 + sizeof(length);
+
+        if (type > static_cast<unsigned char>(RecordType::Warning) || length > size - pos)
+            return false;
+
+        m_records.push_back({ static_cast<RecordType>(type), data + pos, length });
+        pos += length;
+    }
+
+    return true;
+}
+
+AsmFragmentWriter::AsmFragmentWriter(std::uint64_t key) : m_output(g_output), m_collector(&m_text)
+{
+    m_image.assign(kFragmentMagic, sizeof(kFragmentMagic));
+    m_image.append(reinterpret_cast<const char*>(&key), sizeof(key));
+    g_output = &m_collector;
+}
+
+AsmFragmentWriter::~AsmFragmentWriter()
+{
+    g_output = m_output;
+}
+
+void AsmFragmentWriter::AddRecord(AsmFragment::RecordType type, const char* data, std::size_t length)
+{
+    std::uint32_t length32 = length;
+
+    m_image += static_cast<char>(type);
+    m_image.append(reinterpret_cast<const char*>(&length32), sizeof(length32));
+    m_image.append(data, length);
+}
+
+// Moves everything collected since the last include into the fragment and the real output.
+void AsmFragmentWriter::FlushText()
+{
+    m_collector.Flush();
+
+    if (m_text.empty())
+        return;
+
+    AddRecord(AsmFragment::RecordType::Text, m_text.data(), m_text.size());
+    m_output->Write(m_text.data(), m_text.size());
+    m_text.clear();
+}
+
+void AsmFragmentWriter::BeginInclude(const std::string& path, const std::string& warnings)
+{
+    FlushText();
+
+    if (!warnings.empty())
+        AddRecord(AsmFragment::RecordType::Warning, warnings.data(), warnings.size());
+
+    AddRecord(AsmFragment::RecordType::Include, path.data(), path.size());
+    g_output = m_output;
+}
+
+void AsmFragmentWriter::EndInclude()
+{
+    g_output = &m_collector;
+}
+
+const std::string& AsmFragmentWriter::Finish(const std::string& warnings)
+{
+    FlushText();
+
+    if (!warnings.empty())
+        AddRecord(AsmFragment::RecordType::Warning, warnings.data(), warnings.size());
+
+    g_output = m_output;
+    return m_image;
+}
+
+AsmCache::AsmCache(std::string directory, std::uint64_t charmapHash)
+    : m_directory(directory), m_charmapHash(charmapHash)
+{
+    if (!m_directory.empty() && m_directory.back() != '/')
+        m_directory += '/';
+
+    // If this fails, so does every Store, which only costs the reuse.
+    MakeDirectory(m_directory);
+}
+
+std::string AsmCache::FragmentPath(const std::string& filename, bool isInclude) const
+{
+    std::uint64_t hash = HashBytes(&isInclude, sizeof(isInclude));
+
+    hash = HashBytes(filename.data(), filename.size(), hash);
+
+    char name[24];
+    std::snprintf(name, sizeof(name), "%016llx.frag", static_cast<unsigned long long>(hash));
+
+    return m_directory + name;
+}
+
+std::uint64_t AsmCache::FragmentKey(const std::string& filename, const MappedFile& file, bool isInclude) const
+{
+    std::uint64_t nameLength = filename.size();
+    std::uint64_t hash = HashBytes(kFragmentMagic, sizeof(kFragmentMagic), CacheKeySeed());
+
+    hash = HashBytes(&m_charmapHash, sizeof(m_charmapHash), hash);
+    hash = HashBytes(&isInclude, sizeof(isInclude), hash);
+    hash = HashBytes(&nameLength, sizeof(nameLength), hash);
+    hash = HashBytes(filename.data(), filename.size(), hash);
+    hash = HashBytes(file.Data(), file.Size(), hash);
+
+    return hash;
+}
+
+void AsmCache::Store(const std::string& fragmentPath, const std::string& image)
+{
+    WriteFileAtomically(fragmentPath, image);
+}
@@ -0,0 +1,112 @@
+// Copyright(c) 2016 YamaArashi
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#ifndef ASM_CACHE_H
+#define ASM_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "mapped_file.h"
+#include "output_buffer.h"
+
+// The output of preprocessing one asm file, minus the files it includes:
+// runs of output text, the .include paths to splice in between them and
+// the warnings it caused, so that they can be repeated when it is reused.
+class AsmFragment
+{
+public:
+    enum class RecordType : unsigned char
+    {
+        Text,
+        Include,
+        Warning
+    };
+
+    struct Record
+    {
+        RecordType type;
+        const char* data;
+        std::size_t length;
+    };
+
+    // Returns false if the fragment doesn't exist, is malformed or was
+    // made under a different key.
+    bool Open(const std::string& path, std::uint64_t key);
+
+    const std::vector<Record>& Records() const { return m_records; }
+
+private:
+    MappedFile m_file;
+    std::vector<Record> m_records;
+};
+
+// Records the fragment of an asm file while it is being preprocessed.
+// Meanwhile, g_output collects into the fragment, which is passed on to
+// the real output whenever an include is reached and at the end.
+class AsmFragmentWriter
+{
+public:
+    explicit AsmFragmentWriter(std::uint64_t key);
+    AsmFragmentWriter(const AsmFragmentWriter&) = delete;
+    ~AsmFragmentWriter();
+
+    // The included file is written straight to the real output.
+    void BeginInclude(const std::string& path, const std::string& warnings);
+    void EndInclude();
+
+    // Passes on the rest of the output and returns the serialized fragment.
+    const std::string& Finish(const std::string& warnings);
+
+private:
+    OutputBuffer* m_output;
+    std::string m_text;
+    OutputBuffer m_collector;
+    std::string m_image;
+
+    void FlushText();
+    void AddRecord(AsmFragment::RecordType type, const char* data, std::size_t length);
+};
+
+// A directory of fragments. Each file has one, named after its path and
+// whether it was included, which adds a line marker at the start, so that
+// editing the file replaces its fragment instead of adding another. The
+// fragment holds a key hashed from everything its output depends on: the
+// build of preproc, the charmap, the path and the contents of the file.
+class AsmCache
+{
+public:
+    // Makes the directory, so do this before any batch workers start.
+    AsmCache(std::string directory, std::uint64_t charmapHash);
+
+    std::string FragmentPath(const std::string& filename, bool isInclude) const;
+    std::uint64_t FragmentKey(const std::string& filename, const MappedFile& file, bool isInclude) const;
+
+    // Failing to store a fragment only means it will be made again next time.
+    void Store(const std::string& fragmentPath, const std::string& image);
+
+private:
+    std::string m_directory;
+    std::uint64_t m_charmapHash;
+};
+
+#endif // ASM_CACHE_H
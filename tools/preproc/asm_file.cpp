@@ -20,129 +20,202 @@
 
 #include <cstdio>
 #include <cstdarg>
+#include <cstring>
 #include <stdexcept>
+#include <utility>
 #include "preproc.h"
 #include "asm_file.h"
 #include "char_util.h"
+#include "scan.h"
+#include "stats.h"
 #include "utf8.h"
 #include "string_parser.h"
 #include "../../gflib/characters.h"
 
-AsmFile::AsmFile(std::string filename) : m_filename(filename)
+static MappedFile OpenFile(const std::string& filename)
 {
-    FILE *fp = std::fopen(filename.c_str(), "rb");
+    PhaseScope phase(Stats::kRead);
+    MappedFile file;
 
-    if (fp == NULL)
+    if (!file.Open(filename))
         FATAL_ERROR("Failed to open \"%s\" for reading.\n", filename.c_str());
 
-    std::fseek(fp, 0, SEEK_END);
-
-    m_size = std::ftell(fp);
-
-    if (m_size < 0)
-        FATAL_ERROR("File size of \"%s\" is less than zero.\n", filename.c_str());
-    else if (m_size == 0)
-        return; // Empty file
-
-    m_buffer = new char[m_size + 1];
-
-    std::rewind(fp);
-
-    if (std::fread(m_buffer, m_size, 1, fp) != 1)
-        FATAL_ERROR("Failed to read \"%s\".\n", filename.c_str());
+    return file;
+}
 
-    m_buffer[m_size] = 0;
+AsmFile::AsmFile(std::string filename) : AsmFile(filename, OpenFile(filename))
+{
+}
 
-    std::fclose(fp);
+// Takes over a file the caller has already opened.
+AsmFile::AsmFile(std::string filename, MappedFile&& file) : m_file(std::move(file)), m_filename(filename)
+{
+    if (g_stats)
+        g_stats->AddBytesScanned(m_file.Size());
 
-    m_pos = 0;
     m_lineNum = 1;
     m_lineStart = 0;
+    m_stringChar = 0;
+    m_inBlockComment = false;
+    m_strippingDone = false;
 
-    RemoveComments();
+    LoadLine();
 }
 
-AsmFile::AsmFile(AsmFile&& other) : m_filename(std::move(other.m_filename))
+AsmFile::AsmFile(AsmFile&& other)
+    : m_file(std::move(other.m_file)), m_lineCopy(std::move(other.m_lineCopy)), m_filename(std::move(other.m_filename)),
+      m_warnings(std::move(other.m_warnings))
 {
-    m_buffer = other.m_buffer;
+    m_buffer = (other.m_buffer == other.m_lineCopy.c_str()) ? m_lineCopy.c_str() : other.m_buffer;
     m_pos = other.m_pos;
     m_size = other.m_size;
     m_lineNum = other.m_lineNum;
     m_lineStart = other.m_lineStart;
+    m_lineLength = other.m_lineLength;
+    m_stringChar = other.m_stringChar;
+    m_inBlockComment = other.m_inBlockComment;
+    m_strippingDone = other.m_strippingDone;
 
     other.m_buffer = nullptr;
 }
 
-AsmFile::~AsmFile()
-{
-    if (m_size > 0) delete[] m_buffer;
-}
-
-// Removes comments to simplify further processing.
-// It stops upon encountering a null character,
+// Points m_buffer at the line starting at m_lineStart, with comments removed
+// to simplify further processing. Lines without comments are used in place;
+// the others are copied so the mapped file is never written to.
+// Stripping stops for good upon encountering a null character,
 // which may or may not be the end of file marker.
 // If it's not, the error will be caught later.
-void AsmFile::RemoveComments()
+void AsmFile::LoadLine()
 {
+    const char* data = m_file.Data() + m_lineStart;
+    long fileSize = m_file.Size();
+
+    m_buffer = data;
+    m_pos = 0;
+    m_size = fileSize - m_lineStart;
+
+    const char* newline = static_cast<const char*>(std::memchr(data, '\n', m_size));
+    long lineLength = newline ? (newline - data + 1) : m_size;
+
+    m_lineLength = lineLength;
+
+    if (m_strippingDone)
+        return;
+
+    char* line = nullptr;
     long pos = 0;
-    char stringChar = 0;
 
-    for (;;)
+    // Blanks [from, to), switching to a private copy of the line first if needed.
+    auto blank = [&](long from, long to)
     {
-        if (m_buffer[pos] == 0)
-            return;
+        if (line == nullptr)
+        {
+            m_lineCopy.assign(data, lineLength);
+            line = &m_lineCopy[0];
+            m_buffer = m_lineCopy.c_str();
+        }
+        std::memset(line + from, ' ', to - from);
+    };
 
-        if (stringChar != 0)
+    // Most lines have nothing in them to blank out, so jump from one character
+    // that matters to the next rather than looking at every byte.
+    static const char kCodeChars[] = { '@', '/', '"', '\'', '\0' };
+    static const char kBlockCommentChars[] = { '*', '\0' };
+    static const char kLineEndChars[] = { '\n', '\0' };
+
+    while (pos < lineLength)
+    {
+        if (m_inBlockComment)
         {
-            if (m_buffer[pos] == '\\' && m_buffer[pos + 1] == stringChar)
+            long next = FindAny(data + pos, data + lineLength, kBlockCommentChars) - data;
+
+            // Everything but the newline is blanked.
+            long blankEnd = (next == lineLength && data[lineLength - 1] == '\n') ? lineLength - 1 : next;
+
+            if (blankEnd > pos)
+                blank(pos, blankEnd);
+
+            pos = next;
+
+            if (pos >= lineLength)
+                break;
+
+            if (data[pos] == '*' && data[pos + 1] == '/')
             {
+                blank(pos, pos + 2);
                 pos += 2;
+                m_inBlockComment = false;
             }
-            else
+            else if (data[pos] == '*')
             {
-                if (m_buffer[pos] == stringChar)
-                    stringChar = 0;
+                blank(pos, pos + 1);
                 pos++;
             }
         }
-        else if (m_buffer[pos] == '@' && (pos == 0 || m_buffer[pos - 1] != '\\'))
+        else if (m_stringChar != 0)
         {
-            while (m_buffer[pos] != '\n' && m_buffer[pos] != 0)
-                m_buffer[pos++] = ' ';
+            const char stringChars[] = { m_stringChar, '\\', '\0' };
+
+            pos = FindAny(data + pos, data + lineLength, stringChars) - data;
+
+            if (pos >= lineLength)
+                break;
+
+            if (data[pos] == '\\' && data[pos + 1] == m_stringChar)
+            {
+                pos += 2;
+            }
+            else if (data[pos] != 0)
+            {
+                if (data[pos] == m_stringChar)
+                    m_stringChar = 0;
+                pos++;
+            }
         }
-        else if (m_buffer[pos] == '/' && m_buffer[pos + 1] == '*')
+        else
         {
-            m_buffer[pos++] = ' ';
-            m_buffer[pos++] = ' ';
+            pos = FindAny(data + pos, data + lineLength, kCodeChars) - data;
+
+            if (pos >= lineLength)
+                break;
 
-            for (;;)
+            if (data[pos] == '@' && ((m_lineStart + pos) == 0 || data[pos - 1] != '\\'))
             {
-                if (m_buffer[pos] == 0)
-                    return;
-
-                if (m_buffer[pos] == '*' && m_buffer[pos + 1] == '/')
-                {
-                    m_buffer[pos++] = ' ';
-                    m_buffer[pos++] = ' ';
-                    break;
-                }
-                else
-                {
-                    if (m_buffer[pos] != '\n')
-                        m_buffer[pos] = ' ';
-                    pos++;
-                }
+                long commentEnd = FindAny(data + pos, data + lineLength, kLineEndChars) - data;
+                blank(pos, commentEnd);
+                pos = commentEnd;
+            }
+            else if (data[pos] == '/' && data[pos + 1] == '*')
+            {
+                blank(pos, pos + 2);
+                pos += 2;
+                m_inBlockComment = true;
+            }
+            else if (data[pos] != 0)
+            {
+                if (data[pos] == '"' || data[pos] == '\'')
+                    m_stringChar = data[pos];
+                pos++;
             }
         }
-        else
+
+        // Stripping stops for good at a null character.
+        if (pos < lineLength && data[pos] == 0)
         {
-            if (m_buffer[pos] == '"' || m_buffer[pos] == '\'')
-                stringChar = m_buffer[pos];
-            pos++;
+            m_strippingDone = true;
+            return;
         }
     }
 }
 
+// Moves to the line that starts length bytes past the current one.
+void AsmFile::NextLine(long length)
+{
+    m_lineStart += length;
+    m_lineNum++;
+    LoadLine();
+}
+
 // Checks if we're at a particular directive and if so, consumes it.
 // Returns whether the directive was found.
 bool AsmFile::CheckForDirective(std::string name)
@@ -195,9 +268,10 @@ std::string AsmFile::GetGlobalLabel()
 
     if (m_buffer[pos] == ':' && m_buffer[pos + 1] == ':')
     {
+        std::string label(&m_buffer[start], pos - start);
         m_pos = pos + 2;
         ExpectEmptyRestOfLine();
-        return std::string(&m_buffer[start], pos - start);
+        return label;
     }
 
     return std::string();
@@ -251,11 +325,13 @@ std::string AsmFile::ReadPath()
             RaiseError("path is too long");
     }
 
+    std::string path(&m_buffer[startPos], length);
+
     m_pos++; // Go past the right quote.
 
     ExpectEmptyRestOfLine();
 
-    return std::string(&m_buffer[startPos], length);
+    return path;
 }
 
 // Reads a charmap string.
@@ -301,7 +377,7 @@ void AsmFile::VerifyStringLength(int length)
 
 int AsmFile::ReadBraille(unsigned char* s)
 {
-    static std::map<char, unsigned char> encoding =
+    static const std::map<char, unsigned char> encoding =
     {
         { 'A', BRAILLE_CHAR_A },
         { 'B', BRAILLE_CHAR_B },
@@ -418,7 +494,7 @@ int AsmFile::ReadBraille(unsigned char* s)
                 VerifyStringLength(length);
                 s[length++] = BRAILLE_CHAR_NUMBER;
             }
-            else if (inNumber && encoding[c] == BRAILLE_CHAR_SPACE)
+            else if (inNumber && encoding.at(c) == BRAILLE_CHAR_SPACE)
             {
                 // Number ends at a space.
                 // Non-number characters encountered before a space will simply be output as is.
@@ -426,7 +502,7 @@ int AsmFile::ReadBraille(unsigned char* s)
             }
 
             VerifyStringLength(length);
-            s[length++] = encoding[c];
+            s[length++] = encoding.at(c);
             m_pos++;
         }
     }
@@ -501,15 +577,17 @@ int AsmFile::ReadPadLength()
 // Outputs the current line and moves to the next one.
 void AsmFile::OutputLine()
 {
-    while (m_buffer[m_pos] != '\n' && m_buffer[m_pos] != 0)
-        m_pos++;
+    static const char kLineEndChars[] = { '\n', '\0' };
+
+    m_pos = FindAny(m_buffer + m_pos, m_buffer + m_lineLength, kLineEndChars) - m_buffer;
 
     if (m_buffer[m_pos] == 0)
     {
         if (m_pos >= m_size)
         {
             RaiseWarning("file doesn't end with newline");
-            puts(&m_buffer[m_lineStart]);
+            g_output->Write(m_buffer, m_pos);
+            g_output->Put('\n');
         }
         else
         {
@@ -518,12 +596,8 @@ void AsmFile::OutputLine()
     }
     else
     {
-        m_buffer[m_pos] = 0;
-        puts(&m_buffer[m_lineStart]);
-        m_buffer[m_pos] = '\n';
-        m_pos++;
-        m_lineStart = m_pos;
-        m_lineNum++;
+        g_output->Write(m_buffer, m_pos + 1);
+        NextLine(m_pos + 1);
     }
 }
 
@@ -541,15 +615,11 @@ void AsmFile::ExpectEmptyRestOfLine()
     }
     else if (m_buffer[m_pos] == '\n')
     {
-        m_pos++;
-        m_lineStart = m_pos;
-        m_lineNum++;
+        NextLine(m_pos + 1);
     }
     else if (m_buffer[m_pos] == '\r' && m_buffer[m_pos + 1] == '\n')
     {
-        m_pos += 2;
-        m_lineStart = m_pos;
-        m_lineNum++;
+        NextLine(m_pos + 2);
     }
     else
     {
@@ -566,16 +636,31 @@ bool AsmFile::IsAtEnd()
 // Output the current location to set gas's logical file and line numbers.
 void AsmFile::OutputLocation()
 {
-    std::printf("# %ld \"%s\"\n", m_lineNum, m_filename.c_str());
+    g_output->Write("# ", 2);
+    g_output->WriteInt(m_lineNum);
+    g_output->Write(" \"", 2);
+    g_output->Write(m_filename.data(), m_filename.length());
+    g_output->Write("\"\n", 2);
 }
 
-// Reports a diagnostic message.
-void AsmFile::ReportDiagnostic(const char* type, const char* format, std::va_list args)
+// Reports a diagnostic message. Returns it as printed.
+std::string AsmFile::ReportDiagnostic(const char* type, const char* format, std::va_list args)
 {
     const int bufferSize = 1024;
     char buffer[bufferSize];
     std::vsnprintf(buffer, bufferSize, format, args);
-    std::fprintf(stderr, "%s:%ld: %s: %s\n", m_filename.c_str(), m_lineNum, type, buffer);
+
+    std::string message = m_filename + ":" + std::to_string(m_lineNum) + ": " + type + ": " + buffer + "\n";
+    std::fputs(message.c_str(), stderr);
+    return message;
+}
+
+// Returns the warnings reported since the last call, as they were printed.
+std::string AsmFile::TakeWarnings()
+{
+    std::string warnings;
+    warnings.swap(m_warnings);
+    return warnings;
 }
 
 #define DO_REPORT(type)                   \
@@ -594,8 +679,11 @@ void AsmFile::RaiseError(const char* format, ...)
     std::exit(1);
 }
 
-// Reports a warning diagnostic.
+// Reports a warning diagnostic and remembers it for TakeWarnings.
 void AsmFile::RaiseWarning(const char* format, ...)
 {
-    DO_REPORT("warning");
+    std::va_list args;
+    va_start(args, format);
+    m_warnings += ReportDiagnostic("warning", format, args);
+    va_end(args);
 }
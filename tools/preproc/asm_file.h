@@ -25,6 +25,7 @@
 #include <cstdint>
 #include <string>
 #include "preproc.h"
+#include "mapped_file.h"
 
 enum class Directive
 {
@@ -38,9 +39,9 @@ class AsmFile
 {
 public:
     AsmFile(std::string filename);
+    AsmFile(std::string filename, MappedFile&& file);
     AsmFile(AsmFile&& other);
     AsmFile(const AsmFile&) = delete;
-    ~AsmFile();
     Directive GetDirective();
     std::string GetGlobalLabel();
     std::string ReadPath();
@@ -49,22 +50,39 @@ public:
     bool IsAtEnd();
     void OutputLine();
     void OutputLocation();
+    std::string TakeWarnings();
 
 private:
-    char* m_buffer;
+    // The scanner only ever looks at the current line. m_buffer points at its
+    // start, either inside the mapped file or, if the line has comments that
+    // need blanking out, at a stripped copy in m_lineCopy. m_pos and m_size
+    // are relative to m_buffer, with m_size reaching to the end of the file,
+    // but only the m_lineLength bytes of the line itself (and the NUL
+    // after it, if it's the last one) may be read.
+    MappedFile m_file;
+    const char* m_buffer;
     long m_pos;
     long m_size;
+    long m_lineLength;
     long m_lineNum;
     long m_lineStart;
+    std::string m_lineCopy;
     std::string m_filename;
+    std::string m_warnings;
+
+    // Comment stripping state carried over from the previous line.
+    char m_stringChar;
+    bool m_inBlockComment;
+    bool m_strippingDone;
 
     bool ConsumeComma();
     int ReadPadLength();
-    void RemoveComments();
+    void LoadLine();
+    void NextLine(long length);
     bool CheckForDirective(std::string name);
     void SkipWhitespace();
     void ExpectEmptyRestOfLine();
-    void ReportDiagnostic(const char* type, const char* format, std::va_list args);
+    std::string ReportDiagnostic(const char* type, const char* format, std::va_list args);
     void RaiseError(const char* format, ...);
     void RaiseWarning(const char* format, ...);
     void VerifyStringLength(int length);
@@ -0,0 +1,44 @@
+#!/bin/bash
+# Measures preproc throughput over the repo's text data: every data/text/*.inc
+# (through a one-line .include wrapper) and every src/data/text/*.h (as C).
+# Usage: bench.sh [PREPROC...]   (default: tools/preproc/preproc)
+# Pass several binaries to compare them on the same inputs.
+
+set -e
+
+PREPROCS=()
+for preproc in "$@"; do
+    PREPROCS+=("$(cd "$(dirname "$preproc")" && pwd)/$(basename "$preproc")")
+done
+
+cd "$(dirname "$0")/../.."
+
+ITERATIONS=${ITERATIONS:-10}
+[ ${#PREPROCS[@]} -eq 0 ] && PREPROCS=(tools/preproc/preproc)
+
+WORKDIR=$(mktemp -d)
+trap 'rm -rf "$WORKDIR"' EXIT
+
+bytes=0
+for inc in data/text/*.inc; do
+    name=$(basename "$inc" .inc)
+    echo ".include \"$inc\"" > "$WORKDIR/$name.s"
+    echo "$WORKDIR/$name.s /dev/null" >> "$WORKDIR/manifest"
+    bytes=$((bytes + $(wc -c < "$inc")))
+done
+for header in src/data/text/*.h; do
+    name=$(basename "$header" .h)
+    cp "$header" "$WORKDIR/$name.c"
+    echo "$WORKDIR/$name.c /dev/null" >> "$WORKDIR/manifest"
+    bytes=$((bytes + $(wc -c < "$header")))
+done
+
+for preproc in "${PREPROCS[@]}"; do
+    start=$(date +%s%N)
+    for ((i = 0; i < ITERATIONS; i++)); do
+        "$preproc" --batch charmap.txt "$WORKDIR/manifest" > /dev/null
+    done
+    end=$(date +%s%N)
+    ns=$(( (end - start) / ITERATIONS ))
+    echo "$preproc: $bytes bytes in $((ns / 1000)) us per pass ($((bytes * 1000 / ns)) MB/s)"
+done
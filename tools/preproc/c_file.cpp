@@ -28,111 +28,254 @@
 #include "preproc.h"
 #include "c_file.h"
 #include "char_util.h"
+#include "scan.h"
+#include "stats.h"
 #include "utf8.h"
 #include "string_parser.h"
 
 CFile::CFile(const char * filenameCStr, bool isStdin)
 {
-    FILE *fp;
+    m_pos = 0;
+    m_size = 0;
+    m_lineNum = 1;
+    m_isStdin = isStdin;
 
     if (isStdin) {
-        fp = stdin;
+        // Stdin is consumed incrementally by Refill() as Preproc() advances,
+        // so output can start flowing to the next pipeline stage right away.
         m_filename = std::string{"<stdin>/"}.append(filenameCStr);
-    } else {
-        fp = std::fopen(filenameCStr, "rb");
-        m_filename = std::string(filenameCStr);
+        m_fp = stdin;
+        m_isEof = false;
+        m_capacity = kStreamBufferSize;
+        m_streamBuffer = (char *)malloc(m_capacity + 1);
+        if (m_streamBuffer == NULL) {
+            FATAL_ERROR("Failed to allocate memory to process file \"%s\"!", m_filename.c_str());
+        }
+        m_streamBuffer[0] = 0;
+        m_buffer = m_streamBuffer;
+        return;
     }
 
-    std::string& filename = m_filename;
+    m_filename = std::string(filenameCStr);
+    m_fp = NULL;
+    m_isEof = true;
+    m_streamBuffer = NULL;
 
-    if (fp == NULL)
-        FATAL_ERROR("Failed to open \"%s\" for reading.\n", filename.c_str());
+    {
+        PhaseScope phase(Stats::kRead);
 
-    m_size = 0;
-    m_buffer = (char *)malloc(CHUNK_SIZE + 1);
-    if (m_buffer == NULL) {
-        FATAL_ERROR("Failed to allocate memory to process file \"%s\"!", filename.c_str());
+        if (!m_file.Open(m_filename))
+            FATAL_ERROR("Failed to open \"%s\" for reading.\n", m_filename.c_str());
     }
 
-    std::size_t numAllocatedBytes = CHUNK_SIZE + 1;
-    std::size_t bufferOffset = 0;
-    std::size_t count;
+    m_buffer = m_file.Data();
+    m_size = m_file.Size();
+    m_capacity = m_size;
 
-    while ((count = std::fread(m_buffer + bufferOffset, 1, CHUNK_SIZE, fp)) != 0) {
-        if (!std::ferror(fp)) {
-            m_size += count;
+    if (g_stats)
+        g_stats->AddBytesScanned(m_size);
+}
 
-            if (std::feof(fp)) {
-                break;
-            }
+CFile::CFile(CFile&& other) : m_file(std::move(other.m_file)), m_filename(std::move(other.m_filename))
+{
+    m_streamBuffer = other.m_streamBuffer;
+    m_buffer = m_streamBuffer ? m_streamBuffer : m_file.Data();
+    m_pos = other.m_pos;
+    m_size = other.m_size;
+    m_capacity = other.m_capacity;
+    m_lineNum = other.m_lineNum;
+    m_isStdin = other.m_isStdin;
+    m_fp = other.m_fp;
+    m_isEof = other.m_isEof;
 
-            numAllocatedBytes += CHUNK_SIZE;
-            bufferOffset += CHUNK_SIZE;
-            m_buffer = (char *)realloc(m_buffer, numAllocatedBytes);
-            if (m_buffer == NULL) {
-                FATAL_ERROR("Failed to allocate memory to process file \"%s\"!", filename.c_str());
-            }
-        } else {
-            FATAL_ERROR("Failed to read \"%s\". (error: %s)", filename.c_str(), std::strerror(errno));
+    other.m_streamBuffer = NULL;
+    other.m_buffer = NULL;
+}
+
+CFile::~CFile()
+{
+    free(m_streamBuffer);
+}
+
+// Reads the next chunk of streamed input. Everything before the current position
+// is dropped first, except for one byte that TryConvertString looks back at.
+// Pending output is passed on before blocking, so the next stage of the
+// pipeline can work on it while we wait for the previous one.
+void CFile::Refill()
+{
+    if (m_isEof)
+        return;
+
+    g_output->Flush();
+
+    long keepFrom = (m_pos > 0) ? m_pos - 1 : 0;
+
+    if (keepFrom > 0)
+    {
+        std::memmove(m_streamBuffer, m_streamBuffer + keepFrom, m_size - keepFrom);
+        m_size -= keepFrom;
+        m_pos -= keepFrom;
+    }
+
+    // Only a construct that is still being buffered can fill up the buffer.
+    if (m_capacity - m_size < CHUNK_SIZE)
+    {
+        m_capacity *= 2;
+        m_streamBuffer = (char *)realloc(m_streamBuffer, m_capacity + 1);
+        if (m_streamBuffer == NULL) {
+            FATAL_ERROR("Failed to allocate memory to process file \"%s\"!", m_filename.c_str());
         }
     }
 
-    m_buffer[m_size] = 0;
+    std::size_t count;
 
-    std::fclose(fp);
+    {
+        PhaseScope phase(Stats::kRead);
+        count = std::fread(m_streamBuffer + m_size, 1, CHUNK_SIZE, m_fp);
+    }
 
-    m_pos = 0;
-    m_lineNum = 1;
-    m_isStdin = isStdin;
+    if (g_stats)
+        g_stats->AddBytesScanned(count);
+
+    if (count < CHUNK_SIZE)
+    {
+        if (std::ferror(m_fp))
+            FATAL_ERROR("Failed to read \"%s\". (error: %s)", m_filename.c_str(), std::strerror(errno));
+        m_isEof = true;
+    }
+
+    m_size += count;
+    m_streamBuffer[m_size] = 0;
+    m_buffer = m_streamBuffer;
 }
 
-CFile::CFile(CFile&& other) : m_filename(std::move(other.m_filename))
+// Makes sure at least "length" bytes past the current position are buffered, unless the input ends first.
+void CFile::EnsureLookahead(long length)
 {
-    m_buffer = other.m_buffer;
-    m_pos = other.m_pos;
-    m_size = other.m_size;
-    m_lineNum = other.m_lineNum;
-    m_isStdin = other.m_isStdin;
+    while (!m_isEof && m_size - m_pos < length)
+        Refill();
+}
 
-    other.m_buffer = NULL;
+// Returns whether everything a _() or INCBIN_*() construct at the current position
+// could read is already buffered: the identifier, the whitespace after it and,
+// if it is followed by a parenthesis, everything up to the closing one.
+bool CFile::IsConstructBuffered()
+{
+    long pos = m_pos;
+
+    while (pos < m_size && IsIdentifierChar(m_buffer[pos]))
+        pos++;
+
+    while (pos < m_size && (m_buffer[pos] == ' ' || m_buffer[pos] == '\t' || m_buffer[pos] == '\r' || m_buffer[pos] == '\n'))
+        pos++;
+
+    if (pos >= m_size)
+        return false;
+
+    if (m_buffer[pos] != '(')
+        return true;
+
+    bool inString = false;
+
+    for (pos++; pos < m_size; pos++)
+    {
+        if (inString)
+        {
+            if (m_buffer[pos] == '\\')
+                pos++;
+            else if (m_buffer[pos] == '"')
+                inString = false;
+        }
+        else if (m_buffer[pos] == '"')
+        {
+            inString = true;
+        }
+        else if (m_buffer[pos] == ')')
+        {
+            return m_size - pos > kLookahead;
+        }
+    }
+
+    return false;
 }
 
-CFile::~CFile()
+// Before converting a construct from streamed input, reads until all of it is buffered.
+void CFile::BufferConstruct()
 {
-    free(m_buffer);
+    EnsureLookahead(kLookahead);
+
+    while (!m_isEof && !IsConstructBuffered())
+        Refill();
 }
 
+// Characters outside of a string literal that might start something Preproc
+// has to look at: a string, or a _() or INCBIN_*() macro.
+static const char kCodeBoundaryChars[] = { '"', '\'', '_', 'I' };
+
 void CFile::Preproc()
 {
     char stringChar = 0;
 
-    while (m_pos < m_size)
+    for (;;)
     {
+        EnsureLookahead(kLookahead);
+
+        if (m_pos >= m_size)
+            break;
+
+        // Copy everything up to the next character that needs a closer look in one go.
+        const char* spanStart = m_buffer + m_pos;
+        long spanEnd;
+
+        if (stringChar)
+        {
+            const char stringBoundaryChars[] = { stringChar, '\\', '\n' };
+            spanEnd = FindAny(spanStart, m_buffer + m_size, stringBoundaryChars) - m_buffer;
+        }
+        else
+        {
+            spanEnd = FindAnyCountingNewlines(spanStart, m_buffer + m_size, kCodeBoundaryChars, m_lineNum) - m_buffer;
+        }
+
+        if (spanEnd != m_pos)
+        {
+            g_output->Write(&m_buffer[m_pos], spanEnd - m_pos);
+            m_pos = spanEnd;
+            continue;
+        }
+
         if (stringChar)
         {
             if (m_buffer[m_pos] == stringChar)
             {
-                std::putchar(stringChar);
+                g_output->Put(stringChar);
                 m_pos++;
                 stringChar = 0;
             }
             else if (m_buffer[m_pos] == '\\' && m_buffer[m_pos + 1] == stringChar)
             {
-                std::putchar('\\');
-                std::putchar(stringChar);
+                g_output->Put('\\');
+                g_output->Put(stringChar);
                 m_pos += 2;
             }
             else
             {
                 if (m_buffer[m_pos] == '\n')
                     m_lineNum++;
-                std::putchar(m_buffer[m_pos]);
+                g_output->Put(m_buffer[m_pos]);
                 m_pos++;
             }
         }
         else
         {
+            if (!m_isEof)
+                BufferConstruct();
+
             TryConvertString();
+
+            if (!m_isEof)
+                BufferConstruct();
+
             TryConvertIncbin();
 
             if (m_pos >= m_size)
@@ -140,7 +283,7 @@ void CFile::Preproc()
 
             char c = m_buffer[m_pos++];
 
-            std::putchar(c);
+            g_output->Put(c);
 
             if (c == '\n')
                 m_lineNum++;
@@ -169,7 +312,7 @@ bool CFile::ConsumeNewline()
     {
         m_pos += 2;
         m_lineNum++;
-        std::putchar('\n');
+        g_output->Put('\n');
         return true;
     }
 
@@ -177,7 +320,7 @@ bool CFile::ConsumeNewline()
     {
         m_pos++;
         m_lineNum++;
-        std::putchar('\n');
+        g_output->Put('\n');
         return true;
     }
 
@@ -220,7 +363,7 @@ void CFile::TryConvertString()
 
     SkipWhitespace();
 
-    std::printf("{ ");
+    g_output->Write("{ ", 2);
 
     while (1)
     {
@@ -241,8 +384,7 @@ void CFile::TryConvertString()
                 RaiseError(e.what());
             }
 
-            for (int i = 0; i < length; i++)
-                printf("0x%02X, ", s[i]);
+            g_output->WriteCBytes(s, length);
         }
         else if (m_buffer[m_pos] == ')')
         {
@@ -261,9 +403,9 @@ void CFile::TryConvertString()
     }
 
     if (noTerminator)
-        std::printf(" }");
+        g_output->Write(" }", 2);
     else
-        std::printf("0xFF }");
+        g_output->Write("0xFF }", 6);
 }
 
 bool CFile::CheckIdentifier(const std::string& ident)
@@ -355,7 +497,7 @@ void CFile::TryConvertIncbin()
 
     m_pos++;
 
-    std::printf("{");
+    g_output->Put('{');
 
     while (true)
     {
@@ -406,9 +548,15 @@ void CFile::TryConvertIncbin()
             offset += size;
 
             if (isSigned)
-                std::printf("%d,", data);
+            {
+                g_output->WriteInt(data);
+                g_output->Put(',');
+            }
             else
-                std::printf("%uu,", data);
+            {
+                g_output->WriteUnsigned(static_cast<unsigned int>(data));
+                g_output->Write("u,", 2);
+            }
         }
 
         SkipWhitespace();
@@ -424,7 +572,7 @@ void CFile::TryConvertIncbin()
 
     m_pos++;
 
-    std::printf("}");
+    g_output->Put('}');
 }
 
 // Reports a diagnostic message.
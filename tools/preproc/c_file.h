@@ -22,10 +22,12 @@
 #define C_FILE_H
 
 #include <cstdarg>
+#include <cstdio>
 #include <cstdint>
 #include <string>
 #include <memory>
 #include "preproc.h"
+#include "mapped_file.h"
 
 class CFile
 {
@@ -37,12 +39,29 @@ public:
     void Preproc();
 
 private:
-    char* m_buffer;
+    // Files are mapped and scanned in place. Bytes are read from stdin on demand
+    // into m_streamBuffer, so past the current position only kLookahead bytes
+    // are guaranteed to be buffered, and before it only one.
+    // m_buffer[m_size] is always a NUL terminator.
+    static const long kLookahead = 16;
+    static const long kStreamBufferSize = 1 << 16;
+
+    MappedFile m_file;
+    char* m_streamBuffer;
+    const char* m_buffer;
     long m_pos;
     long m_size;
+    long m_capacity;
     long m_lineNum;
     std::string m_filename;
     bool m_isStdin;
+    std::FILE* m_fp;
+    bool m_isEof;
+
+    void Refill();
+    void EnsureLookahead(long length);
+    bool IsConstructBuffered();
+    void BufferConstruct();
 
     bool ConsumeHorizontalWhitespace();
     bool ConsumeNewline();
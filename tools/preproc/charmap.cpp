@@ -21,9 +21,13 @@
 #include <cstdio>
 #include <cstdint>
 #include <cstdarg>
+#include <cstring>
+#include <vector>
 #include "preproc.h"
 #include "charmap.h"
 #include "char_util.h"
+#include "file_util.h"
+#include "hash.h"
 #include "utf8.h"
 
 enum LhsType
@@ -44,9 +48,8 @@ struct Lhs
 class CharmapReader
 {
 public:
-    CharmapReader(std::string filename);
+    CharmapReader(std::string filename, const char* buffer, long size);
     CharmapReader(const CharmapReader&) = delete;
-    ~CharmapReader();
     Lhs ReadLhs();
     void ExpectEqualsSign();
     std::string ReadSequence();
@@ -54,51 +57,24 @@ public:
     void RaiseError(const char* format, ...);
 
 private:
-    char* m_buffer;
+    const char* m_buffer;
     long m_pos;
     long m_size;
     long m_lineNum;
     std::string m_filename;
 
-    void RemoveComments();
     std::string ReadConstant();
     void SkipWhitespace();
 };
 
-CharmapReader::CharmapReader(std::string filename) : m_filename(filename)
+// The buffer must be NUL-terminated at m_size. It is read in place; comments
+// are skipped over by SkipWhitespace rather than removed up front.
+CharmapReader::CharmapReader(std::string filename, const char* buffer, long size) : m_filename(filename)
 {
-    FILE *fp = std::fopen(filename.c_str(), "rb");
-
-    if (fp == NULL)
-        FATAL_ERROR("Failed to open \"%s\" for reading.\n", filename.c_str());
-
-    std::fseek(fp, 0, SEEK_END);
-
-    m_size = std::ftell(fp);
-
-    if (m_size < 0)
-        FATAL_ERROR("File size of \"%s\" is less than zero.\n", filename.c_str());
-
-    m_buffer = new char[m_size + 1];
-
-    std::rewind(fp);
-
-    if (std::fread(m_buffer, m_size, 1, fp) != 1)
-        FATAL_ERROR("Failed to read \"%s\".\n", filename.c_str());
-
-    m_buffer[m_size] = 0;
-
-    std::fclose(fp);
-
+    m_buffer = buffer;
+    m_size = size;
     m_pos = 0;
     m_lineNum = 1;
-
-    RemoveComments();
-}
-
-CharmapReader::~CharmapReader()
-{
-    delete[] m_buffer;
 }
 
 Lhs CharmapReader::ReadLhs()
@@ -316,43 +292,6 @@ void CharmapReader::RaiseError(const char* format, ...)
     std::exit(1);
 }
 
-void CharmapReader::RemoveComments()
-{
-    long pos = 0;
-    bool inString = false;
-
-    for (;;)
-    {
-        if (m_buffer[pos] == 0)
-            return;
-
-        if (inString)
-        {
-            if (m_buffer[pos] == '\\' && m_buffer[pos + 1] == '\'')
-            {
-                pos += 2;
-            }
-            else
-            {
-                if (m_buffer[pos] == '\'')
-                    inString = false;
-                pos++;
-            }
-        }
-        else if (m_buffer[pos] == '@')
-        {
-            while (m_buffer[pos] != '\n' && m_buffer[pos] != 0)
-                m_buffer[pos++] = ' ';
-        }
-        else
-        {
-            if (m_buffer[pos] == '\'')
-                inString = true;
-            pos++;
-        }
-    }
-}
-
 std::string CharmapReader::ReadConstant()
 {
     long startPos = m_pos;
@@ -363,22 +302,79 @@ std::string CharmapReader::ReadConstant()
     return std::string(&m_buffer[startPos], m_pos - startPos);
 }
 
+// Skips tabs, spaces and any comment that runs to the end of the line.
+// Character literals are read without going through here, so an '@' inside one isn't a comment.
 void CharmapReader::SkipWhitespace()
 {
     while (m_buffer[m_pos] == '\t' || m_buffer[m_pos] == ' ')
         m_pos++;
+
+    if (m_buffer[m_pos] == '@')
+    {
+        while (m_buffer[m_pos] != '\n' && m_buffer[m_pos] != 0)
+            m_pos++;
+    }
+}
+
+// Layout of the charmap image, which is also the binary snapshot written by
+// --charmap-cache: a CacheHeader, 128 escape sequences, the page index,
+// the pages of BMP chars, the sorted non-BMP chars, the constant hash table,
+// and finally the byte arena that every Sequence points into. The source
+// hash is seeded with preproc's version, so a snapshot made by another build
+// is rebuilt; the magic only needs to change with the layout.
+static const char kCacheMagic[8] = { 'P', 'P', 'C', 'M', 'A', 'P', 0, 2 };
+
+struct CacheHeader
+{
+    char magic[8];
+    std::uint64_t sourceHash;
+    std::uint32_t pageCount;
+    std::uint32_t extraCharCount;
+    std::uint32_t constantSlotCount;
+    std::uint32_t arenaSize;
+};
+
+static const int kPageIndexCount = 0x10000 >> 8;
+
+static std::uint32_t HashConstant(const char* name, std::size_t length)
+{
+    return static_cast<std::uint32_t>(HashBytes(name, length));
 }
 
-Charmap::Charmap(std::string filename)
+Charmap::Charmap(std::string filename, std::string cachePath)
 {
-    CharmapReader reader(filename);
+    MappedFile source;
+
+    if (!source.Open(filename))
+        FATAL_ERROR("Failed to open \"%s\" for reading.\n", filename.c_str());
+
+    std::uint64_t sourceHash = HashBytes(source.Data(), source.Size(), CacheKeySeed());
+
+    m_sourceHash = sourceHash;
+
+    if (!cachePath.empty() && m_imageFile.Open(cachePath)
+     && AttachImage(m_imageFile.Data(), m_imageFile.Size(), sourceHash))
+        return;
+
+    Parse(filename, source, sourceHash);
+
+    if (!cachePath.empty())
+        WriteFileAtomically(cachePath, m_image);
+}
+
+void Charmap::Parse(std::string filename, const MappedFile& source, std::uint64_t sourceHash)
+{
+    CharmapReader reader(filename, source.Data(), source.Size());
+    std::map<std::int32_t, std::string> chars;
+    std::string escapes[128];
+    std::map<std::string, std::string> constants;
 
     for (;;)
     {
         Lhs lhs = reader.ReadLhs();
 
         if (lhs.type == LhsType::None)
-            return;
+            break;
 
         reader.ExpectEqualsSign();
 
@@ -387,22 +383,217 @@ Charmap::Charmap(std::string filename)
         switch (lhs.type)
         {
         case LhsType::Char:
-            if (m_chars.find(lhs.code) != m_chars.end())
+            if (chars.find(lhs.code) != chars.end())
                 reader.RaiseError("redefining char");
-            m_chars[lhs.code] = sequence;
+            chars[lhs.code] = sequence;
             break;
         case LhsType::Escape:
-            if (m_escapes[lhs.code].length() != 0)
+            if (escapes[lhs.code].length() != 0)
                 reader.RaiseError("redefining escape");
-            m_escapes[lhs.code] = sequence;
+            escapes[lhs.code] = sequence;
             break;
         case LhsType::Constant:
-            if (m_constants.find(lhs.name) != m_constants.end())
+            if (constants.find(lhs.name) != constants.end())
                 reader.RaiseError("redefining constant");
-            m_constants[lhs.name] = sequence;
+            constants[lhs.name] = sequence;
             break;
         }
 
         reader.ExpectEmptyRestOfLine();
     }
+
+    BuildImage(chars, escapes, constants, sourceHash);
+
+    if (!AttachImage(m_image.data(), m_image.size(), sourceHash))
+        FATAL_ERROR("Failed to build the charmap tables for \"%s\".\n", filename.c_str());
+}
+
+// Lays out the parsed tables as one image in m_image.
+void Charmap::BuildImage(const std::map<std::int32_t, std::string>& chars, const std::string* escapes,
+                         const std::map<std::string, std::string>& constants, std::uint64_t sourceHash)
+{
+    std::string arena;
+
+    auto addSequence = [&](const std::string& bytes)
+    {
+        Sequence seq = { static_cast<std::uint32_t>(arena.size()), static_cast<std::uint32_t>(bytes.size()) };
+        arena += bytes;
+        return seq;
+    };
+
+    std::vector<Sequence> escapeTable(128);
+
+    for (int i = 0; i < 128; i++)
+        escapeTable[i] = addSequence(escapes[i]);
+
+    std::vector<std::uint16_t> pageIndex(kPageIndexCount, 0);
+    std::vector<Sequence> pages(256, Sequence{ 0, 0 });
+    std::vector<ExtraCharEntry> extraChars;
+
+    // std::map iterates in code order, so extraChars comes out sorted.
+    for (const auto& pair : chars)
+    {
+        std::int32_t code = pair.first;
+
+        if (code >= 0 && code < 0x10000)
+        {
+            if (pageIndex[code >> 8] == 0)
+            {
+                pageIndex[code >> 8] = pages.size() / 256;
+                pages.resize(pages.size() + 256, Sequence{ 0, 0 });
+            }
+
+            pages[(pageIndex[code >> 8] << 8) | (code & 0xFF)] = addSequence(pair.second);
+        }
+        else
+        {
+            extraChars.push_back({ code, addSequence(pair.second) });
+        }
+    }
+
+    // Open addressing with linear probing at a load factor of at most 1/2.
+    std::uint32_t slotCount = 1;
+
+    while (slotCount < 2 * constants.size())
+        slotCount *= 2;
+
+    std::vector<ConstantSlot> slots(slotCount, ConstantSlot{ 0, { 0, 0 }, { 0, 0 } });
+
+    for (const auto& pair : constants)
+    {
+        std::uint32_t hash = HashConstant(pair.first.data(), pair.first.size());
+        std::uint32_t slot = hash & (slotCount - 1);
+
+        while (slots[slot].name.length != 0)
+            slot = (slot + 1) & (slotCount - 1);
+
+        slots[slot].hash = hash;
+        slots[slot].name = addSequence(pair.first);
+        slots[slot].sequence = addSequence(pair.second);
+    }
+
+    CacheHeader header;
+    std::memcpy(header.magic, kCacheMagic, sizeof(kCacheMagic));
+    header.sourceHash = sourceHash;
+    header.pageCount = pages.size() / 256;
+    header.extraCharCount = extraChars.size();
+    header.constantSlotCount = slotCount;
+    header.arenaSize = arena.size();
+
+    m_image.clear();
+    m_image.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    m_image.append(reinterpret_cast<const char*>(escapeTable.data()), escapeTable.size() * sizeof(Sequence));
+    m_image.append(reinterpret_cast<const char*>(pageIndex.data()), pageIndex.size() * sizeof(std::uint16_t));
+    m_image.append(reinterpret_cast<const char*>(pages.data()), pages.size() * sizeof(Sequence));
+    m_image.append(reinterpret_cast<const char*>(extraChars.data()), extraChars.size() * sizeof(ExtraCharEntry));
+    m_image.append(reinterpret_cast<const char*>(slots.data()), slots.size() * sizeof(ConstantSlot));
+    m_image += arena;
+}
+
+// Points the lookup tables into an image, either m_image or a mapped snapshot.
+// Returns false if it is truncated, malformed or was made from a different charmap.
+bool Charmap::AttachImage(const char* image, std::size_t size, std::uint64_t sourceHash)
+{
+    if (size < sizeof(CacheHeader))
+        return false;
+
+    const CacheHeader* header = reinterpret_cast<const CacheHeader*>(image);
+
+    if (std::memcmp(header->magic, kCacheMagic, sizeof(kCacheMagic)) != 0 || header->sourceHash != sourceHash)
+        return false;
+
+    if (header->pageCount == 0 || header->pageCount > kPageIndexCount + 1 || header->constantSlotCount == 0
+     || (header->constantSlotCount & (header->constantSlotCount - 1)) != 0)
+        return false;
+
+    std::size_t escapesStart = sizeof(CacheHeader);
+    std::size_t pageIndexStart = escapesStart + 128 * sizeof(Sequence);
+    std::size_t pagesStart = pageIndexStart + kPageIndexCount * sizeof(std::uint16_t);
+    std::size_t extraCharsStart = pagesStart + (std::size_t)header->pageCount * 256 * sizeof(Sequence);
+    std::size_t slotsStart = extraCharsStart + (std::size_t)header->extraCharCount * sizeof(ExtraCharEntry);
+    std::size_t arenaStart = slotsStart + (std::size_t)header->constantSlotCount * sizeof(ConstantSlot);
+
+    if (size != arenaStart + header->arenaSize)
+        return false;
+
+    const char* base = image;
+    m_escapes = reinterpret_cast<const Sequence*>(base + escapesStart);
+    m_pageIndex = reinterpret_cast<const std::uint16_t*>(base + pageIndexStart);
+    m_pages = reinterpret_cast<const Sequence*>(base + pagesStart);
+    m_extraChars = reinterpret_cast<const ExtraCharEntry*>(base + extraCharsStart);
+    m_extraCharCount = header->extraCharCount;
+    m_constantSlots = reinterpret_cast<const ConstantSlot*>(base + slotsStart);
+    m_constantSlotMask = header->constantSlotCount - 1;
+    m_arena = reinterpret_cast<const unsigned char*>(base + arenaStart);
+
+    // Every lookup after this is unchecked, so validate the whole image once.
+    auto isValid = [header](Sequence seq)
+    {
+        return seq.offset <= header->arenaSize && seq.length <= header->arenaSize - seq.offset;
+    };
+
+    for (int i = 0; i < 128; i++)
+        if (!isValid(m_escapes[i]))
+            return false;
+
+    for (int i = 0; i < kPageIndexCount; i++)
+        if (m_pageIndex[i] >= header->pageCount)
+            return false;
+
+    for (std::size_t i = 0; i < (std::size_t)header->pageCount * 256; i++)
+        if (!isValid(m_pages[i]) || (i < 256 && m_pages[i].length != 0))
+            return false;
+
+    for (std::uint32_t i = 0; i < m_extraCharCount; i++)
+        if (!isValid(m_extraChars[i].sequence) || (i > 0 && m_extraChars[i - 1].code >= m_extraChars[i].code))
+            return false;
+
+    std::uint32_t usedSlots = 0;
+
+    for (std::uint32_t i = 0; i <= m_constantSlotMask; i++)
+    {
+        if (!isValid(m_constantSlots[i].name) || !isValid(m_constantSlots[i].sequence))
+            return false;
+        if (m_constantSlots[i].name.length != 0)
+            usedSlots++;
+    }
+
+    // Lookups stop at an empty slot, so there must be at least one.
+    return usedSlots <= m_constantSlotMask;
+}
+
+ByteSpan Charmap::ExtraChar(std::int32_t code) const
+{
+    std::uint32_t low = 0;
+    std::uint32_t high = m_extraCharCount;
+
+    while (low < high)
+    {
+        std::uint32_t mid = low + (high - low) / 2;
+
+        if (m_extraChars[mid].code < code)
+            low = mid + 1;
+        else if (m_extraChars[mid].code > code)
+            high = mid;
+        else
+            return Span(m_extraChars[mid].sequence);
+    }
+
+    return { m_arena, 0 };
+}
+
+ByteSpan Charmap::Constant(const char* name, std::size_t length) const
+{
+    std::uint32_t hash = HashConstant(name, length);
+
+    for (std::uint32_t slot = hash & m_constantSlotMask;; slot = (slot + 1) & m_constantSlotMask)
+    {
+        const ConstantSlot& entry = m_constantSlots[slot];
+
+        if (entry.name.length == 0)
+            return { m_arena, 0 };
+
+        if (entry.hash == hash && entry.name.length == length && std::memcmp(m_arena + entry.name.offset, name, length) == 0)
+            return Span(entry.sequence);
+    }
 }
@@ -21,44 +21,94 @@
 #ifndef CHARMAP_H
 #define CHARMAP_H
 
+#include <cstddef>
 #include <cstdint>
 #include <string>
 #include <map>
 #include <vector>
+#include "mapped_file.h"
 
+// A byte sequence owned by the Charmap. An empty sequence means "not mapped".
+struct ByteSpan
+{
+    const unsigned char* data;
+    std::size_t length;
+};
+
+// The charmap is kept as one contiguous image: a small header, flat lookup
+// tables and a byte arena that every table entry points into. The same image
+// is what --charmap-cache writes to disk, so loading a snapshot is just
+// mapping it back in and checking that it is well-formed.
 class Charmap
 {
 public:
-    Charmap(std::string filename);
+    Charmap(std::string filename, std::string cachePath = std::string());
 
-    std::string Char(std::int32_t code)
+    // BMP code points are looked up through a two-level table of 256-entry pages,
+    // where every unused page shares the empty page 0.
+    ByteSpan Char(std::int32_t code) const
     {
-        auto it = m_chars.find(code);
+        if (code >= 0 && code < 0x10000)
+            return Span(m_pages[(m_pageIndex[code >> 8] << 8) | (code & 0xFF)]);
 
-        if (it == m_chars.end())
-            return std::string();
+        return ExtraChar(code);
+    }
 
-        return it->second;
+    ByteSpan Escape(unsigned char code) const
+    {
+        return Span(m_escapes[code]);
     }
 
-    std::string Escape(unsigned char code)
+    ByteSpan Constant(const char* name, std::size_t length) const;
+
+    // Hash of the charmap source, for keying anything derived from it.
+    std::uint64_t SourceHash() const
     {
-        return m_escapes[code];
+        return m_sourceHash;
     }
 
-    std::string Constant(std::string identifier)
+    struct Sequence
+    {
+        std::uint32_t offset;
+        std::uint32_t length;
+    };
+
+private:
+    struct ExtraCharEntry
+    {
+        std::int32_t code;
+        Sequence sequence;
+    };
+
+    struct ConstantSlot
     {
-        auto it = m_constants.find(identifier);
+        std::uint32_t hash;
+        Sequence name;
+        Sequence sequence;
+    };
 
-        if (it == m_constants.end())
-            return std::string();
+    std::uint64_t m_sourceHash;
+    MappedFile m_imageFile;
+    std::string m_image;
+    const Sequence* m_escapes;
+    const std::uint16_t* m_pageIndex;
+    const Sequence* m_pages;
+    const ExtraCharEntry* m_extraChars;
+    std::uint32_t m_extraCharCount;
+    const ConstantSlot* m_constantSlots;
+    std::uint32_t m_constantSlotMask;
+    const unsigned char* m_arena;
 
-        return it->second;
+    ByteSpan Span(Sequence seq) const
+    {
+        return { m_arena + seq.offset, seq.length };
     }
-private:
-    std::map<std::int32_t, std::string> m_chars;
-    std::string m_escapes[128];
-    std::map<std::string, std::string> m_constants;
+
+    ByteSpan ExtraChar(std::int32_t code) const;
+    void Parse(std::string filename, const MappedFile& source, std::uint64_t sourceHash);
+    void BuildImage(const std::map<std::int32_t, std::string>& chars, const std::string* escapes,
+                    const std::map<std::string, std::string>& constants, std::uint64_t sourceHash);
+    bool AttachImage(const char* image, std::size_t size, std::uint64_t sourceHash);
 };
 
 #endif // CHARMAP_H
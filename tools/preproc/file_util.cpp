@@ -0,0 +1,83 @@
+// Copyright(c) 2016 YamaArashi
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <string>
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#include <process.h>
+#define getpid _getpid
+#define mkdir(path, mode) _mkdir(path)
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "file_util.h"
+
+bool WriteFileAtomically(const std::string& path, const std::string& contents)
+{
+    static std::atomic<unsigned> s_tempCounter(0);
+
+    std::string tempPath = path + ".tmp" + std::to_string(getpid()) + "." + std::to_string(s_tempCounter++);
+
+    FILE *fp = std::fopen(tempPath.c_str(), "wb");
+
+    if (fp == NULL)
+        return false;
+
+    bool ok = (contents.empty() || std::fwrite(contents.data(), contents.size(), 1, fp) == 1);
+
+    if (std::fclose(fp) != 0)
+        ok = false;
+
+    // Unlike rename, MoveFileEx can replace an existing file on Windows.
+    // Either way, whatever is at "path" now is complete.
+#ifdef _WIN32
+    if (ok)
+        ok = MoveFileExA(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    if (ok)
+        ok = std::rename(tempPath.c_str(), path.c_str()) == 0;
+#endif
+
+    if (!ok)
+    {
+        std::remove(tempPath.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool MakeDirectory(const std::string& path)
+{
+    // Parents that can't be made will make the last mkdir fail anyway.
+    for (std::size_t i = 1; i < path.size(); i++)
+    {
+        if (path[i] == '/' || path[i] == '\\')
+            mkdir(path.substr(0, i).c_str(), 0777);
+    }
+
+    return mkdir(path.c_str(), 0777) == 0 || errno == EEXIST;
+}
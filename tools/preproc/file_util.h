@@ -0,0 +1,37 @@
+// Copyright(c) 2016 YamaArashi
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#ifndef FILE_UTIL_H
+#define FILE_UTIL_H
+
+#include <string>
+
+// Writes "contents" to a temporary file next to "path" and renames it into place,
+// so that concurrent preproc processes never observe a partially written file.
+// Anything already at "path" is replaced.
+// Returns false if the file couldn't be written; callers treat that as a cache miss.
+bool WriteFileAtomically(const std::string& path, const std::string& contents);
+
+// Creates a directory, along with any missing parents.
+// Returns false if it doesn't exist afterwards.
+bool MakeDirectory(const std::string& path);
+
+#endif // FILE_UTIL_H
@@ -0,0 +1,57 @@
+// Copyright(c) 2016 YamaArashi
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <cstddef>
+#include <cstdint>
+
+const std::uint64_t kHashSeed = 0xCBF29CE484222325ULL;
+
+// 64-bit FNV-1a. Used to key on-disk caches on file contents,
+// so it only needs to be cheap and well-distributed, not secure.
+inline std::uint64_t HashBytes(const void* data, std::size_t size, std::uint64_t hash = kHashSeed)
+{
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+
+    for (std::size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+// The Makefile sets this to a checksum of preproc's sources.
+#ifndef PREPROC_VERSION
+#define PREPROC_VERSION __DATE__ " " __TIME__
+#endif
+
+// Seeds the keys of the on-disk caches, so that anything cached by a
+// different build of preproc is never reused.
+inline std::uint64_t CacheKeySeed()
+{
+    return HashBytes(PREPROC_VERSION, sizeof(PREPROC_VERSION) - 1);
+}
+
+#endif // HASH_H
@@ -0,0 +1,133 @@
+// Copyright(c) 2016 YamaArashi
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#include <cstdio>
+#include <utility>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "mapped_file.h"
+
+MappedFile::MappedFile(MappedFile&& other)
+    : m_data(other.m_data), m_size(other.m_size), m_mapping(other.m_mapping),
+      m_mappingSize(other.m_mappingSize), m_copy(std::move(other.m_copy))
+{
+    other.m_data = nullptr;
+    other.m_size = 0;
+    other.m_mapping = nullptr;
+    other.m_mappingSize = 0;
+}
+
+MappedFile::~MappedFile()
+{
+    Close();
+}
+
+void MappedFile::Close()
+{
+#ifndef _WIN32
+    if (m_mapping != nullptr)
+        munmap(m_mapping, m_mappingSize);
+#endif
+
+    m_mapping = nullptr;
+    m_mappingSize = 0;
+    m_copy.reset();
+    m_data = nullptr;
+    m_size = 0;
+}
+
+bool MappedFile::Open(const std::string& path)
+{
+    Close();
+
+#ifndef _WIN32
+    int fd = open(path.c_str(), O_RDONLY);
+
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        close(fd);
+        return false;
+    }
+
+    long pageSize = sysconf(_SC_PAGESIZE);
+
+    if (st.st_size > 0 && pageSize > 0 && (st.st_size % pageSize) != 0)
+    {
+        void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (mapping != MAP_FAILED)
+        {
+            close(fd);
+            m_mapping = mapping;
+            m_mappingSize = st.st_size;
+            m_data = static_cast<const char*>(mapping);
+            m_size = st.st_size;
+            return true;
+        }
+    }
+
+    close(fd);
+#endif
+
+    FILE* fp = std::fopen(path.c_str(), "rb");
+
+    if (fp == NULL)
+        return false;
+
+    std::fseek(fp, 0, SEEK_END);
+
+    long size = std::ftell(fp);
+
+    if (size < 0)
+    {
+        std::fclose(fp);
+        return false;
+    }
+
+    m_copy.reset(new char[size + 1]);
+
+    std::rewind(fp);
+
+    bool ok = (size == 0 || std::fread(m_copy.get(), size, 1, fp) == 1);
+
+    std::fclose(fp);
+
+    if (!ok)
+    {
+        m_copy.reset();
+        return false;
+    }
+
+    m_copy[size] = 0;
+    m_data = m_copy.get();
+    m_size = size;
+
+    return true;
+}
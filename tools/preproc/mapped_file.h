@@ -0,0 +1,59 @@
+// Copyright(c) 2016 YamaArashi
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+// A read-only view of a whole file. Where possible the file is memory-mapped,
+// so it is scanned straight out of the page cache without being copied.
+// The contents are always followed by a NUL byte: the tail of the last page
+// of a mapping is zero-filled, and when the size is an exact multiple of the
+// page size (or mapping isn't available) the file is read into a buffer instead.
+class MappedFile
+{
+public:
+    MappedFile() : m_data(nullptr), m_size(0), m_mapping(nullptr), m_mappingSize(0) {}
+    MappedFile(MappedFile&& other);
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile();
+
+    // Returns false if the file can't be opened or read.
+    bool Open(const std::string& path);
+
+    const char* Data() const { return m_data; }
+    long Size() const { return m_size; }
+
+private:
+    const char* m_data;
+    long m_size;
+    void* m_mapping;
+    std::size_t m_mappingSize;
+    std::unique_ptr<char[]> m_copy;
+
+    void Close();
+};
+
+#endif // MAPPED_FILE_H
@@ -0,0 +1,146 @@
+// Copyright(c) 2016 YamaArashi
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#include <cstdio>
+#include <cstring>
+#include "preproc.h"
+#include "output_buffer.h"
+#include "stats.h"
+
+// "0x00, " through "0xFF, ", so a mapped byte is emitted with a single copy.
+struct HexByteTable
+{
+    char entries[256][6];
+
+    HexByteTable()
+    {
+        const char* digits = "0123456789ABCDEF";
+
+        for (int i = 0; i < 256; i++)
+        {
+            entries[i][0] = '0';
+            entries[i][1] = 'x';
+            entries[i][2] = digits[i >> 4];
+            entries[i][3] = digits[i & 0xF];
+            entries[i][4] = ',';
+            entries[i][5] = ' ';
+        }
+    }
+};
+
+static const HexByteTable s_hexBytes;
+
+OutputBuffer::~OutputBuffer()
+{
+    Flush();
+}
+
+// Hands everything written so far to the output file, including stdio's own buffer,
+// so a process reading from the other end of a pipe sees it immediately.
+void OutputBuffer::Flush()
+{
+    if (m_sink != nullptr)
+    {
+        m_sink->append(m_buffer.get(), m_length);
+        m_length = 0;
+        return;
+    }
+
+    PhaseScope phase(Stats::kOutput);
+
+    if (m_length != 0 && std::fwrite(m_buffer.get(), m_length, 1, m_fp) != 1)
+        FATAL_ERROR("Failed to write output.\n");
+
+    m_length = 0;
+
+    std::fflush(m_fp);
+}
+
+void OutputBuffer::WriteSlow(const char* data, std::size_t length)
+{
+    Flush();
+
+    if (m_sink != nullptr)
+    {
+        m_sink->append(data, length);
+    }
+    else if (length < kBufferSize)
+    {
+        std::memcpy(m_buffer.get(), data, length);
+        m_length = length;
+    }
+    else
+    {
+        PhaseScope phase(Stats::kOutput);
+
+        if (std::fwrite(data, length, 1, m_fp) != 1)
+            FATAL_ERROR("Failed to write output.\n");
+    }
+}
+
+// Writes "\t.byte 0x.., 0x..\n", or nothing for an empty string.
+void OutputBuffer::WriteAsmBytes(const unsigned char* s, int length)
+{
+    if (length <= 0)
+        return;
+
+    Write("\t.byte ", 7);
+
+    for (int i = 0; i < length - 1; i++)
+        Write(s_hexBytes.entries[s[i]], 6);
+
+    Write(s_hexBytes.entries[s[length - 1]], 4);
+    Put('\n');
+}
+
+// Writes "0x.., " for every byte, as used inside C initializers.
+void OutputBuffer::WriteCBytes(const unsigned char* s, int length)
+{
+    for (int i = 0; i < length; i++)
+        Write(s_hexBytes.entries[s[i]], 6);
+}
+
+void OutputBuffer::WriteInt(long value)
+{
+    if (value < 0)
+    {
+        Put('-');
+        WriteUnsigned(0UL - (unsigned long)value);
+    }
+    else
+    {
+        WriteUnsigned(value);
+    }
+}
+
+void OutputBuffer::WriteUnsigned(unsigned long value)
+{
+    char digits[24];
+    char* p = digits + sizeof(digits);
+
+    do
+    {
+        *--p = '0' + (value % 10);
+        value /= 10;
+    } while (value != 0);
+
+    Write(p, digits + sizeof(digits) - p);
+}
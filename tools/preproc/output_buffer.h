@@ -0,0 +1,86 @@
+// Copyright(c) 2016 YamaArashi
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#ifndef OUTPUT_BUFFER_H
+#define OUTPUT_BUFFER_H
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+
+// Collects output in a large buffer and hands it to stdio in big blocks,
+// so copying input through costs a memcpy rather than a call per byte.
+// It can also collect into a string, which is then its destination instead.
+// The buffer is on the heap, since one is live per nested cached include and
+// batch workers run on threads with small stacks.
+class OutputBuffer
+{
+public:
+    OutputBuffer(std::FILE* fp) : m_fp(fp), m_sink(nullptr), m_length(0), m_buffer(new char[kBufferSize]) {}
+    OutputBuffer(std::string* sink) : m_fp(nullptr), m_sink(sink), m_length(0), m_buffer(new char[kBufferSize]) {}
+    OutputBuffer(const OutputBuffer&) = delete;
+    ~OutputBuffer();
+
+    void Write(const char* data, std::size_t length)
+    {
+        if (length > kBufferSize - m_length)
+        {
+            WriteSlow(data, length);
+            return;
+        }
+
+        std::memcpy(m_buffer.get() + m_length, data, length);
+        m_length += length;
+    }
+
+    void Write(const char* s)
+    {
+        Write(s, std::strlen(s));
+    }
+
+    void Put(char c)
+    {
+        if (m_length == kBufferSize)
+            Flush();
+
+        m_buffer[m_length++] = c;
+    }
+
+    void WriteAsmBytes(const unsigned char* s, int length);
+    void WriteCBytes(const unsigned char* s, int length);
+    void WriteInt(long value);
+    void WriteUnsigned(unsigned long value);
+    void Flush();
+
+private:
+    static const std::size_t kBufferSize = 1 << 16;
+
+    std::FILE* m_fp;
+    std::string* m_sink;
+    std::size_t m_length;
+    std::unique_ptr<char[]> m_buffer;
+
+    void WriteSlow(const char* data, std::size_t length);
+};
+
+#endif // OUTPUT_BUFFER_H
@@ -18,83 +18,90 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 // THE SOFTWARE.
 
+#include <algorithm>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <string>
-#include <stack>
+#include <thread>
+#include <utility>
+#include <vector>
 #include "preproc.h"
+#include "asm_cache.h"
 #include "asm_file.h"
 #include "c_file.h"
 #include "charmap.h"
+#include "stats.h"
 
 Charmap* g_charmap;
+thread_local OutputBuffer* g_output;
 
-void PrintAsmBytes(unsigned char *s, int length)
-{
-    if (length > 0)
-    {
-        std::printf("\t.byte ");
-        for (int i = 0; i < length; i++)
-        {
-            std::printf("0x%02X", s[i]);
+static AsmCache* s_asmCache;
 
-            if (i < length - 1)
-                std::printf(", ");
-        }
-        std::putchar('\n');
-    }
-}
+static void PreprocAsmFile(std::string filename, bool isInclude);
 
-void PreprocAsmFile(std::string filename)
+// Preprocesses what's left of an asm file. Included files are preprocessed
+// in place; if the output is being recorded, the writer is told about them.
+static void PreprocAsmLines(AsmFile& file, AsmFragmentWriter* writer)
 {
-    std::stack<AsmFile> stack;
-
-    stack.push(AsmFile(filename));
-
-    for (;;)
+    while (!file.IsAtEnd())
     {
-        while (stack.top().IsAtEnd())
-        {
-            stack.pop();
-
-            if (stack.empty())
-                return;
-            else
-                stack.top().OutputLocation();
-        }
-
-        Directive directive = stack.top().GetDirective();
+        Directive directive = file.GetDirective();
 
         switch (directive)
         {
         case Directive::Include:
-            stack.push(AsmFile(stack.top().ReadPath()));
-            stack.top().OutputLocation();
+        {
+            std::string path = file.ReadPath();
+
+            if (writer != nullptr)
+                writer->BeginInclude(path, file.TakeWarnings());
+
+            PreprocAsmFile(path, true);
+
+            if (writer != nullptr)
+                writer->EndInclude();
+
+            file.OutputLocation();
             break;
+        }
         case Directive::String:
         {
             unsigned char s[kMaxStringLength];
-            int length = stack.top().ReadString(s);
-            PrintAsmBytes(s, length);
+            int length = file.ReadString(s);
+            g_output->WriteAsmBytes(s, length);
             break;
         }
         case Directive::Braille:
         {
             unsigned char s[kMaxStringLength];
-            int length = stack.top().ReadBraille(s);
-            PrintAsmBytes(s, length);
+            int length;
+            {
+                PhaseScope phase(Stats::kEncode);
+                length = file.ReadBraille(s);
+                if (g_stats)
+                    g_stats->AddStringEncoded(0);
+            }
+            g_output->WriteAsmBytes(s, length);
             break;
         }
         case Directive::Unknown:
         {
-            std::string globalLabel = stack.top().GetGlobalLabel();
+            std::string globalLabel = file.GetGlobalLabel();
 
             if (globalLabel.length() != 0)
             {
-                const char *s = globalLabel.c_str();
-                std::printf("%s: ; .global %s\n", s, s);
+                g_output->Write(globalLabel.data(), globalLabel.length());
+                g_output->Write(": ; .global ");
+                g_output->Write(globalLabel.data(), globalLabel.length());
+                g_output->Put('\n');
             }
             else
             {
-                stack.top().OutputLine();
+                file.OutputLine();
             }
 
             break;
@@ -103,6 +110,78 @@ void PreprocAsmFile(std::string filename)
     }
 }
 
+// Splices a cached fragment into the output, along with the files it includes.
+static void SpliceAsmFragment(const AsmFragment& fragment)
+{
+    for (const AsmFragment::Record& record : fragment.Records())
+    {
+        switch (record.type)
+        {
+        case AsmFragment::RecordType::Text:
+            g_output->Write(record.data, record.length);
+            break;
+        case AsmFragment::RecordType::Include:
+            PreprocAsmFile(std::string(record.data, record.length), true);
+            break;
+        case AsmFragment::RecordType::Warning:
+            std::fwrite(record.data, record.length, 1, stderr);
+            break;
+        }
+    }
+}
+
+// Preprocesses an asm file. With an include cache, the output of every file
+// is saved as a fragment and later files that are unchanged reuse it,
+// so that only the files that were edited get encoded again.
+static void PreprocAsmFile(std::string filename, bool isInclude)
+{
+    if (s_asmCache == nullptr)
+    {
+        AsmFile file(filename);
+
+        if (isInclude)
+            file.OutputLocation();
+
+        PreprocAsmLines(file, nullptr);
+        return;
+    }
+
+    MappedFile source;
+    std::string fragmentPath;
+    std::uint64_t fragmentKey;
+    AsmFragment fragment;
+    bool isCached;
+
+    {
+        PhaseScope phase(Stats::kRead);
+
+        if (!source.Open(filename))
+            FATAL_ERROR("Failed to open \"%s\" for reading.\n", filename.c_str());
+
+        fragmentPath = s_asmCache->FragmentPath(filename, isInclude);
+        fragmentKey = s_asmCache->FragmentKey(filename, source, isInclude);
+        isCached = fragment.Open(fragmentPath, fragmentKey);
+    }
+
+    if (isCached)
+    {
+        if (g_stats)
+            g_stats->AddFragmentReused(source.Size());
+
+        SpliceAsmFragment(fragment);
+        return;
+    }
+
+    AsmFile file(filename, std::move(source));
+    AsmFragmentWriter writer(fragmentKey);
+
+    if (isInclude)
+        file.OutputLocation();
+
+    PreprocAsmLines(file, &writer);
+    s_asmCache->Store(fragmentPath, writer.Finish(file.TakeWarnings()));
+}
+
 void PreprocCFile(const char * filename, bool isStdin)
 {
     CFile cFile(filename, isStdin);
@@ -130,35 +209,377 @@ char* GetFileExtension(char* filename)
     return extension;
 }
 
-int main(int argc, char **argv)
+// Preprocesses one file, dispatching on its extension.
+void PreprocFile(char* filename, bool isStdin)
 {
-    if (argc < 3 || argc > 4)
-    {
-        std::fprintf(stderr, "Usage: %s SRC_FILE CHARMAP_FILE [-i]\nwhere -i denotes if input is from stdin\n", argv[0]);
-        return 1;
-    }
+    PhaseScope phase(Stats::kScan);
 
-    g_charmap = new Charmap(argv[2]);
+    if (g_stats)
+        g_stats->BeginInput(filename);
 
-    char* extension = GetFileExtension(argv[1]);
+    char* extension = GetFileExtension(filename);
 
     if (!extension)
-        FATAL_ERROR("\"%s\" has no file extension.\n", argv[1]);
+        FATAL_ERROR("\"%s\" has no file extension.\n", filename);
 
     if ((extension[0] == 's') && extension[1] == 0)
-        PreprocAsmFile(argv[1]);
-    else if ((extension[0] == 'c' || extension[0] == 'i') && extension[1] == 0) {
-        if (argc == 4) {
-            if (argv[3][0] == '-' && argv[3][1] == 'i' && argv[3][2] == '\0') {
-                PreprocCFile(argv[1], true);
-            } else {
-                FATAL_ERROR("unknown argument flag \"%s\".\n", argv[3]);
+        PreprocAsmFile(filename, false);
+    else if ((extension[0] == 'c' || extension[0] == 'i') && extension[1] == 0)
+        PreprocCFile(filename, isStdin);
+    else
+        FATAL_ERROR("\"%s\" has an unknown file extension of \"%s\".\n", filename, extension);
+
+    if (g_stats)
+        g_stats->EndInput();
+}
+
+// Reads one line of a batch manifest, without the newline.
+// Returns false at the end of the file.
+static bool ReadManifestLine(std::FILE* fp, std::string& line)
+{
+    int c;
+
+    line.clear();
+
+    while ((c = std::getc(fp)) != EOF && c != '\n')
+    {
+        if (c != '\r')
+            line += static_cast<char>(c);
+    }
+
+    return c != EOF || !line.empty();
+}
+
+// Preprocesses one batch job into its own output file.
+static void RunBatchJob(std::string srcPath, const std::string& outPath)
+{
+    std::FILE* outFile = std::fopen(outPath.c_str(), "w");
+
+    if (outFile == NULL)
+        FATAL_ERROR("Failed to open \"%s\" for writing.\n", outPath.c_str());
+
+    {
+        OutputBuffer output(outFile);
+        g_output = &output;
+        PreprocFile(&srcPath[0], false);
+    }
+
+    if (std::fclose(outFile) != 0)
+        FATAL_ERROR("Failed to write \"%s\".\n", outPath.c_str());
+}
+
+// Runs batch jobs on a pool of worker threads. Every job has its own output
+// file and the charmap is only ever read. Besides the queue, the workers share
+// the include cache, whose directory is made before they start and whose
+// fragments are written atomically. Finished jobs are reported in the order
+// they were queued, then dropped from the queue.
+class BatchPool
+{
+public:
+    BatchPool(int threadCount, bool isServer);
+    BatchPool(const BatchPool&) = delete;
+
+    void Add(const std::string& srcPath, const std::string& outPath);
+
+    // Waits for every queued job to finish.
+    void Finish();
+
+private:
+    struct Job
+    {
+        std::string srcPath;
+        std::string outPath;
+        bool isDone;
+    };
+
+    bool m_isServer;
+    Stats* m_stats;
+    std::mutex m_mutex;
+    std::condition_variable m_jobAdded;
+    std::deque<Job> m_jobs;
+    std::size_t m_nextJob;
+    bool m_isClosed;
+    std::vector<std::thread> m_threads;
+
+    void Work();
+};
+
+BatchPool::BatchPool(int threadCount, bool isServer)
+    : m_isServer(isServer), m_stats(g_stats), m_nextJob(0), m_isClosed(false)
+{
+    for (int i = 0; i < threadCount; i++)
+        m_threads.emplace_back(&BatchPool::Work, this);
+}
+
+void BatchPool::Add(const std::string& srcPath, const std::string& outPath)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_jobs.push_back({ srcPath, outPath, false });
+    }
+
+    m_jobAdded.notify_one();
+}
+
+void BatchPool::Finish()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_isClosed = true;
+    }
+
+    m_jobAdded.notify_all();
+
+    for (std::thread& thread : m_threads)
+        thread.join();
+}
+
+void BatchPool::Work()
+{
+    std::unique_ptr<Stats> stats;
+
+    if (m_stats != nullptr)
+    {
+        stats.reset(new Stats());
+        g_stats = stats.get();
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    for (;;)
+    {
+        m_jobAdded.wait(lock, [this] { return m_nextJob < m_jobs.size() || m_isClosed; });
+
+        if (m_nextJob == m_jobs.size())
+            break;
+
+        // A deque doesn't move its elements when it grows or loses its front,
+        // and only finished jobs are dropped, so the job can be used unlocked.
+        Job& job = m_jobs[m_nextJob++];
+
+        lock.unlock();
+        RunBatchJob(job.srcPath, job.outPath);
+        lock.lock();
+
+        job.isDone = true;
+
+        while (!m_jobs.empty() && m_jobs.front().isDone)
+        {
+            if (m_isServer)
+            {
+                std::printf("%s\n", m_jobs.front().outPath.c_str());
+                std::fflush(stdout);
             }
-        } else {
-            PreprocCFile(argv[1], false);
+
+            m_jobs.pop_front();
+            m_nextJob--;
+        }
+    }
+
+    if (stats)
+    {
+        stats->Switch(Stats::kOther);
+        m_stats->Merge(*stats);
+    }
+}
+
+// Processes jobs of the form "SRC_FILE OUT_FILE", one per line, with the
+// charmap that was loaded at startup. When the jobs come from stdin, the
+// output path of each finished job is echoed to stdout so that a driver
+// on the other end of the pipe knows when it can be consumed.
+// With more than one thread, jobs run in parallel but are still echoed
+// in the order they were given.
+void PreprocBatch(const char* manifestPath, int threadCount)
+{
+    std::FILE* manifest = stdin;
+    bool isServer = (manifestPath == nullptr);
+
+    if (!isServer)
+    {
+        manifest = std::fopen(manifestPath, "rb");
+
+        if (manifest == NULL)
+            FATAL_ERROR("Failed to open \"%s\" for reading.\n", manifestPath);
+    }
+
+    std::unique_ptr<BatchPool> pool;
+
+    if (threadCount > 1)
+        pool.reset(new BatchPool(threadCount, isServer));
+
+    std::string line;
+    long lineNum = 0;
+
+    while (ReadManifestLine(manifest, line))
+    {
+        lineNum++;
+
+        std::size_t srcStart = line.find_first_not_of(" \t");
+
+        if (srcStart == std::string::npos)
+            continue;
+
+        std::size_t srcEnd = line.find_first_of(" \t", srcStart);
+        std::size_t outStart = (srcEnd == std::string::npos) ? srcEnd : line.find_first_not_of(" \t", srcEnd);
+        std::size_t outEnd = (outStart == std::string::npos) ? outStart : line.find_first_of(" \t", outStart);
+
+        if (outStart == std::string::npos || (outEnd != std::string::npos && line.find_first_not_of(" \t", outEnd) != std::string::npos))
+            FATAL_ERROR("%s:%ld: error: expected \"SRC_FILE OUT_FILE\"\n", isServer ? "<stdin>" : manifestPath, lineNum);
+
+        std::string srcPath = line.substr(srcStart, srcEnd - srcStart);
+        std::string outPath = line.substr(outStart, outEnd == std::string::npos ? outEnd : outEnd - outStart);
+
+        if (pool)
+        {
+            pool->Add(srcPath, outPath);
+            continue;
+        }
+
+        RunBatchJob(srcPath, outPath);
+
+        if (isServer)
+        {
+            std::printf("%s\n", outPath.c_str());
+            std::fflush(stdout);
         }
-    } else
-        FATAL_ERROR("\"%s\" has an unknown file extension of \"%s\".\n", argv[1], extension);
+    }
+
+    if (pool)
+        pool->Finish();
+
+    if (!isServer)
+        std::fclose(manifest);
+}
+
+static void LoadCharmap(const char* charmapPath, const std::string& charmapCachePath, const std::string& includeCachePath)
+{
+    PhaseScope phase(Stats::kCharmap);
+
+    g_charmap = new Charmap(charmapPath, charmapCachePath);
+
+    if (!includeCachePath.empty())
+        s_asmCache = new AsmCache(includeCachePath, g_charmap->SourceHash());
+}
+
+const char* const USAGE =
+    "Usage: %s [OPTIONS] SRC_FILE CHARMAP_FILE [-i]\n"
+    "       %s [OPTIONS] --batch CHARMAP_FILE [MANIFEST_FILE]\n"
+    "where -i denotes if input is from stdin\n"
+    "and MANIFEST_FILE lists \"SRC_FILE OUT_FILE\" jobs, one per line\n"
+    "(jobs are read from stdin if it is omitted)\n"
+    "\n"
+    "Options:\n"
+    "  --charmap-cache FILE  reuse a binary snapshot of the charmap, rebuilding it\n"
+    "                        if it doesn't match the contents of CHARMAP_FILE\n"
+    "  --include-cache DIR   save the output of every asm file and .include in DIR\n"
+    "                        and reuse it while the file and charmap are unchanged\n"
+    "  --stats FILE          append time per phase and work done as a line of JSON\n"
+    "                        to FILE, or to stderr if FILE is \"-\"\n"
+    "  --jobs N              run batch jobs on N threads (0 means one per core);\n"
+    "                        outputs are the same as with one\n";
+
+int main(int argc, char **argv)
+{
+    bool isBatch = false;
+    std::string charmapCachePath;
+    std::string includeCachePath;
+    std::string statsPath;
+    int threadCount = 1;
+    int argi = 1;
+
+    while (argi < argc && argv[argi][0] == '-' && argv[argi][1] == '-')
+    {
+        if (std::strcmp(argv[argi], "--batch") == 0)
+        {
+            isBatch = true;
+        }
+        else if (std::strcmp(argv[argi], "--charmap-cache") == 0)
+        {
+            if (argi + 1 >= argc)
+                FATAL_ERROR("No path following \"--charmap-cache\".\n");
+            charmapCachePath = argv[++argi];
+        }
+        else if (std::strcmp(argv[argi], "--include-cache") == 0)
+        {
+            if (argi + 1 >= argc)
+                FATAL_ERROR("No path following \"--include-cache\".\n");
+            includeCachePath = argv[++argi];
+        }
+        else if (std::strcmp(argv[argi], "--stats") == 0)
+        {
+            if (argi + 1 >= argc)
+                FATAL_ERROR("No path following \"--stats\".\n");
+            statsPath = argv[++argi];
+        }
+        else if (std::strcmp(argv[argi], "--jobs") == 0)
+        {
+            char* end;
+
+            if (argi + 1 >= argc)
+                FATAL_ERROR("No number following \"--jobs\".\n");
+
+            threadCount = std::strtol(argv[++argi], &end, 10);
+
+            if (*end != 0 || threadCount < 0)
+                FATAL_ERROR("Invalid number of jobs \"%s\".\n", argv[argi]);
+
+            if (threadCount == 0)
+                threadCount = std::max(1U, std::thread::hardware_concurrency());
+        }
+        else
+        {
+            FATAL_ERROR("unknown option \"%s\".\n", argv[argi]);
+        }
+
+        argi++;
+    }
+
+    if (!statsPath.empty())
+        g_stats = new Stats();
+
+    int numArgs = argc - argi;
+
+    if (isBatch ? (numArgs < 1 || numArgs > 2) : (numArgs < 2 || numArgs > 3))
+    {
+        std::fprintf(stderr, USAGE, argv[0], argv[0]);
+        return 1;
+    }
+
+    if (isBatch)
+    {
+        LoadCharmap(argv[argi], charmapCachePath, includeCachePath);
+        PreprocBatch(numArgs == 2 ? argv[argi + 1] : nullptr, threadCount);
+
+        if (g_stats)
+            g_stats->Write(statsPath);
+
+        return 0;
+    }
+
+    char* srcPath = argv[argi];
+    bool isStdin = false;
+
+    if (numArgs == 3)
+    {
+        char* flag = argv[argi + 2];
+
+        if (flag[0] == '-' && flag[1] == 'i' && flag[2] == '\0')
+            isStdin = true;
+        else
+            FATAL_ERROR("unknown argument flag \"%s\".\n", flag);
+    }
+
+    LoadCharmap(argv[argi + 1], charmapCachePath, includeCachePath);
+    OutputBuffer output(stdout);
+    g_output = &output;
+
+    PreprocFile(srcPath, isStdin);
+
+    if (g_stats)
+    {
+        output.Flush();
+        g_stats->Write(statsPath);
+    }
 
     return 0;
 }
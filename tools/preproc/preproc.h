@@ -24,6 +24,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include "charmap.h"
+#include "output_buffer.h"
 
 #ifdef _MSC_VER
 
@@ -50,5 +51,6 @@ const int kMaxStringLength = 1024;
 const unsigned long kMaxCharmapSequenceLength = 16;
 
 extern Charmap* g_charmap;
+extern thread_local OutputBuffer* g_output;
 
 #endif // PREPROC_H
@@ -0,0 +1,141 @@
+// Copyright(c) 2016 YamaArashi
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <cstddef>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Kernels for skipping over the bytes that are copied through unchanged,
+// comparing a whole vector of input against every interesting character at once.
+// They use AVX2 when the compiler targets it, SSE2 (always there on x86-64)
+// otherwise, and plain loops on other architectures.
+
+#if defined(__AVX2__)
+typedef __m256i ScanVector;
+const std::size_t kScanStride = 32;
+
+inline ScanVector ScanLoad(const char* p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+inline ScanVector ScanSplat(char c) { return _mm256_set1_epi8(c); }
+inline ScanVector ScanEq(ScanVector a, ScanVector b) { return _mm256_cmpeq_epi8(a, b); }
+inline ScanVector ScanOr(ScanVector a, ScanVector b) { return _mm256_or_si256(a, b); }
+inline unsigned ScanMask(ScanVector v) { return static_cast<unsigned>(_mm256_movemask_epi8(v)); }
+#define SCAN_VECTORIZED
+#elif defined(__SSE2__)
+typedef __m128i ScanVector;
+const std::size_t kScanStride = 16;
+
+inline ScanVector ScanLoad(const char* p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+inline ScanVector ScanSplat(char c) { return _mm_set1_epi8(c); }
+inline ScanVector ScanEq(ScanVector a, ScanVector b) { return _mm_cmpeq_epi8(a, b); }
+inline ScanVector ScanOr(ScanVector a, ScanVector b) { return _mm_or_si128(a, b); }
+inline unsigned ScanMask(ScanVector v) { return static_cast<unsigned>(_mm_movemask_epi8(v)); }
+#define SCAN_VECTORIZED
+#endif
+
+// Returns the first byte in [p, end) that equals one of "chars", or end if there is none.
+template <std::size_t N>
+inline const char* FindAny(const char* p, const char* end, const char (&chars)[N])
+{
+#ifdef SCAN_VECTORIZED
+    ScanVector splats[N];
+
+    for (std::size_t i = 0; i < N; i++)
+        splats[i] = ScanSplat(chars[i]);
+
+    for (; end - p >= static_cast<std::ptrdiff_t>(kScanStride); p += kScanStride)
+    {
+        ScanVector v = ScanLoad(p);
+        ScanVector hits = ScanEq(v, splats[0]);
+
+        for (std::size_t i = 1; i < N; i++)
+            hits = ScanOr(hits, ScanEq(v, splats[i]));
+
+        unsigned mask = ScanMask(hits);
+
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+    }
+#endif
+
+    for (; p < end; p++)
+    {
+        for (std::size_t i = 0; i < N; i++)
+            if (*p == chars[i])
+                return p;
+    }
+
+    return end;
+}
+
+// Like FindAny, but also adds the number of newlines that were skipped over to "newlines".
+template <std::size_t N>
+inline const char* FindAnyCountingNewlines(const char* p, const char* end, const char (&chars)[N], long& newlines)
+{
+#ifdef SCAN_VECTORIZED
+    ScanVector splats[N];
+    ScanVector newline = ScanSplat('\n');
+
+    for (std::size_t i = 0; i < N; i++)
+        splats[i] = ScanSplat(chars[i]);
+
+    for (; end - p >= static_cast<std::ptrdiff_t>(kScanStride); p += kScanStride)
+    {
+        ScanVector v = ScanLoad(p);
+        ScanVector hits = ScanEq(v, splats[0]);
+
+        for (std::size_t i = 1; i < N; i++)
+            hits = ScanOr(hits, ScanEq(v, splats[i]));
+
+        unsigned mask = ScanMask(hits);
+        unsigned newlineMask = ScanMask(ScanEq(v, newline));
+
+        if (mask != 0)
+        {
+            // Only count the newlines before the hit.
+            newlines += __builtin_popcount(newlineMask & ((mask & -mask) - 1));
+            return p + __builtin_ctz(mask);
+        }
+
+        newlines += __builtin_popcount(newlineMask);
+    }
+#endif
+
+    for (; p < end; p++)
+    {
+        for (std::size_t i = 0; i < N; i++)
+            if (*p == chars[i])
+                return p;
+
+        if (*p == '\n')
+            newlines++;
+    }
+
+    return end;
+}
+
+#endif // SCAN_H
@@ -0,0 +1,193 @@
+// Copyright(c) 2016 YamaArashi
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#include <algorithm>
+#include <cstdio>
+#include "preproc.h"
+#include "stats.h"
+
+thread_local Stats* g_stats;
+
+static const char* const kPhaseNames[Stats::kPhaseCount] = { "other", "charmap", "read", "scan", "encode", "output" };
+
+// How many of the largest inputs are listed.
+static const std::size_t kMaxListedInputs = 10;
+
+Stats::Stats()
+    : m_phase(kOther), m_start(Clock::now()), m_lastSwitch(m_start), m_inputStart(m_start),
+      m_bytesScanned(0), m_stringsEncoded(0), m_charmapLookups(0), m_fragmentsReused(0), m_bytesReused(0)
+{
+    for (int i = 0; i < kPhaseCount; i++)
+        m_phaseTimes[i] = Clock::duration::zero();
+}
+
+Stats::Phase Stats::Switch(Phase phase)
+{
+    Clock::time_point now = Clock::now();
+    Phase previous = m_phase;
+
+    m_phaseTimes[m_phase] += now - m_lastSwitch;
+    m_lastSwitch = now;
+    m_phase = phase;
+
+    return previous;
+}
+
+// Inputs are the files named on the command line or in the manifest;
+// the bytes of everything they include, scanned or reused from the include
+// cache, are counted towards them.
+void Stats::BeginInput(const std::string& path)
+{
+    m_inputs.push_back({ path, m_bytesScanned + m_bytesReused, 0 });
+    m_inputStart = Clock::now();
+}
+
+void Stats::EndInput()
+{
+    Input& input = m_inputs.back();
+
+    input.bytes = m_bytesScanned + m_bytesReused - input.bytes;
+    input.microseconds = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - m_inputStart).count();
+}
+
+void Stats::AddBytesScanned(std::uint64_t bytes)
+{
+    m_bytesScanned += bytes;
+}
+
+void Stats::AddStringEncoded(std::uint64_t charmapLookups)
+{
+    m_stringsEncoded++;
+    m_charmapLookups += charmapLookups;
+}
+
+void Stats::AddFragmentReused(std::uint64_t sourceBytes)
+{
+    m_fragmentsReused++;
+    m_bytesReused += sourceBytes;
+}
+
+void Stats::Merge(const Stats& other)
+{
+    for (int i = 0; i < kPhaseCount; i++)
+        m_phaseTimes[i] += other.m_phaseTimes[i];
+
+    m_bytesScanned += other.m_bytesScanned;
+    m_stringsEncoded += other.m_stringsEncoded;
+    m_charmapLookups += other.m_charmapLookups;
+    m_fragmentsReused += other.m_fragmentsReused;
+    m_bytesReused += other.m_bytesReused;
+    m_inputs.insert(m_inputs.end(), other.m_inputs.begin(), other.m_inputs.end());
+}
+
+static std::string JsonString(const std::string& s)
+{
+    std::string json = "\"";
+
+    for (unsigned char c : s)
+    {
+        if (c == '"' || c == '\\')
+        {
+            json += '\\';
+            json += c;
+        }
+        else if (c < 0x20)
+        {
+            char escape[8];
+            std::snprintf(escape, sizeof(escape), "\\u%04x", c);
+            json += escape;
+        }
+        else
+        {
+            json += c;
+        }
+    }
+
+    return json + "\"";
+}
+
+static std::string JsonNumber(std::uint64_t n)
+{
+    return std::to_string(n);
+}
+
+static std::uint64_t Microseconds(std::chrono::steady_clock::duration d)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+}
+
+void Stats::Write(const std::string& path)
+{
+    Switch(m_phase);
+
+    std::vector<Input> largest = m_inputs;
+
+    std::stable_sort(largest.begin(), largest.end(), [](const Input& a, const Input& b) { return a.bytes > b.bytes; });
+
+    if (largest.size() > kMaxListedInputs)
+        largest.resize(kMaxListedInputs);
+
+    std::string json = "{\"phases_us\":{";
+
+    for (int i = 0; i < kPhaseCount; i++)
+    {
+        if (i != 0)
+            json += ",";
+        json += JsonString(kPhaseNames[i]) + ":" + JsonNumber(Microseconds(m_phaseTimes[i]));
+    }
+
+    json += "},\"total_us\":" + JsonNumber(Microseconds(m_lastSwitch - m_start));
+    json += ",\"inputs\":" + JsonNumber(m_inputs.size());
+    json += ",\"bytes_scanned\":" + JsonNumber(m_bytesScanned);
+    json += ",\"strings_encoded\":" + JsonNumber(m_stringsEncoded);
+    json += ",\"charmap_lookups\":" + JsonNumber(m_charmapLookups);
+    json += ",\"fragments_reused\":" + JsonNumber(m_fragmentsReused);
+    json += ",\"bytes_reused\":" + JsonNumber(m_bytesReused);
+    json += ",\"largest_inputs\":[";
+
+    for (std::size_t i = 0; i < largest.size(); i++)
+    {
+        if (i != 0)
+            json += ",";
+        json += "{\"path\":" + JsonString(largest[i].path);
+        json += ",\"bytes\":" + JsonNumber(largest[i].bytes);
+        json += ",\"us\":" + JsonNumber(largest[i].microseconds) + "}";
+    }
+
+    json += "]}\n";
+
+    if (path == "-")
+    {
+        std::fputs(json.c_str(), stderr);
+        return;
+    }
+
+    // One write per process, so parallel builds appending to the same file don't interleave lines.
+    std::FILE* fp = std::fopen(path.c_str(), "ab");
+
+    if (fp == NULL)
+        FATAL_ERROR("Failed to open \"%s\" for writing.\n", path.c_str());
+
+    std::setvbuf(fp, NULL, _IOFBF, json.size());
+
+    if (std::fwrite(json.data(), json.size(), 1, fp) != 1 || std::fclose(fp) != 0)
+        FATAL_ERROR("Failed to write \"%s\".\n", path.c_str());
+}
@@ -0,0 +1,109 @@
+// Copyright(c) 2016 YamaArashi
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Where preproc's time goes and how much work it did, collected for --stats.
+// Time is attributed to whichever phase is current, so nested phases
+// (encoding a string while scanning a file) are not counted twice.
+// Every batch worker thread has its own, so phase times are summed over threads.
+class Stats
+{
+public:
+    enum Phase
+    {
+        kOther,
+        kCharmap,
+        kRead,
+        kScan,
+        kEncode,
+        kOutput,
+        kPhaseCount
+    };
+
+    Stats();
+
+    // Makes "phase" the current one and returns the previous one.
+    Phase Switch(Phase phase);
+
+    void BeginInput(const std::string& path);
+    void EndInput();
+
+    void AddBytesScanned(std::uint64_t bytes);
+    void AddStringEncoded(std::uint64_t charmapLookups);
+    // "sourceBytes" is the size of the file whose fragment was reused.
+    void AddFragmentReused(std::uint64_t sourceBytes);
+
+    // Adds the phase times, counters and inputs of a worker thread's Stats.
+    void Merge(const Stats& other);
+
+    // Writes everything as one line of JSON, appending to the file ("-" is stderr).
+    void Write(const std::string& path);
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Input
+    {
+        std::string path;
+        std::uint64_t bytes;
+        std::uint64_t microseconds;
+    };
+
+    Phase m_phase;
+    Clock::time_point m_start;
+    Clock::time_point m_lastSwitch;
+    Clock::time_point m_inputStart;
+    Clock::duration m_phaseTimes[kPhaseCount];
+    std::uint64_t m_bytesScanned;
+    std::uint64_t m_stringsEncoded;
+    std::uint64_t m_charmapLookups;
+    std::uint64_t m_fragmentsReused;
+    std::uint64_t m_bytesReused;
+    std::vector<Input> m_inputs;
+};
+
+extern thread_local Stats* g_stats;
+
+// Attributes the time spent in a scope to a phase, if --stats is on.
+class PhaseScope
+{
+public:
+    PhaseScope(Stats::Phase phase) : m_previous(g_stats ? g_stats->Switch(phase) : phase) {}
+    PhaseScope(const PhaseScope&) = delete;
+
+    ~PhaseScope()
+    {
+        if (g_stats)
+            g_stats->Switch(m_previous);
+    }
+
+private:
+    Stats::Phase m_previous;
+};
+
+#endif // STATS_H
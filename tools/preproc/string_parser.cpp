@@ -20,16 +20,42 @@
 
 #include <cstdio>
 #include <cstdarg>
+#include <cstring>
 #include <stdexcept>
 #include "preproc.h"
 #include "string_parser.h"
+#include "stats.h"
 #include "char_util.h"
 #include "utf8.h"
 
+// Appends mapped bytes to the destination string.
+void StringParser::AppendBytes(const unsigned char* bytes, std::size_t length)
+{
+    if (length > (std::size_t)(kMaxStringLength - m_destLength))
+        RaiseError("mapped string longer than %d bytes", kMaxStringLength);
+
+    std::memcpy(m_dest + m_destLength, bytes, length);
+    m_destLength += length;
+}
+
+// Appends an integer in little-endian order.
+void StringParser::AppendInteger(Integer integer)
+{
+    unsigned char bytes[4] =
+    {
+        (unsigned char)integer.value,
+        (unsigned char)(integer.value >> 8),
+        (unsigned char)(integer.value >> 16),
+        (unsigned char)(integer.value >> 24),
+    };
+
+    AppendBytes(bytes, integer.size);
+}
+
 // Reads a charmap char or escape sequence.
-std::string StringParser::ReadCharOrEscape()
+void StringParser::ReadCharOrEscape()
 {
-    std::string sequence;
+    ByteSpan sequence;
 
     bool isEscape = (m_buffer[m_pos] == '\\');
 
@@ -40,20 +66,24 @@ std::string StringParser::ReadCharOrEscape()
         if (m_buffer[m_pos] == '"')
         {
             sequence = g_charmap->Char('"');
+            m_charmapLookups++;
 
-            if (sequence.length() == 0)
+            if (sequence.length == 0)
                 RaiseError("no mapping exists for double quote");
 
-            return sequence;
+            AppendBytes(sequence.data, sequence.length);
+            return;
         }
         else if (m_buffer[m_pos] == '\\')
         {
             sequence = g_charmap->Char('\\');
+            m_charmapLookups++;
 
-            if (sequence.length() == 0)
+            if (sequence.length == 0)
                 RaiseError("no mapping exists for backslash");
 
-            return sequence;
+            AppendBytes(sequence.data, sequence.length);
+            return;
         }
     }
 
@@ -81,8 +111,9 @@ std::string StringParser::ReadCharOrEscape()
         RaiseError("escapes using non-ASCII characters are invalid");
 
     sequence = isEscape ? g_charmap->Escape(code) : g_charmap->Char(code);
+    m_charmapLookups++;
 
-    if (sequence.length() == 0)
+    if (sequence.length == 0)
     {
         if (isEscape)
             RaiseError("unknown escape '\\%c'", code);
@@ -90,14 +121,12 @@ std::string StringParser::ReadCharOrEscape()
             RaiseError("unknown character U+%X", code);
     }
 
-    return sequence;
+    AppendBytes(sequence.data, sequence.length);
 }
 
 // Reads a charmap constant, i.e. "{FOO}".
-std::string StringParser::ReadBracketedConstants()
+void StringParser::ReadBracketedConstants()
 {
-    std::string totalSequence;
-
     m_pos++; // Assume we're on the left curly bracket.
 
     while (m_buffer[m_pos] != '}')
@@ -113,36 +142,20 @@ std::string StringParser::ReadBracketedConstants()
             while (IsIdentifierChar(m_buffer[m_pos]))
                 m_pos++;
 
-            std::string sequence = g_charmap->Constant(std::string(&m_buffer[startPos], m_pos - startPos));
+            ByteSpan sequence = g_charmap->Constant(&m_buffer[startPos], m_pos - startPos);
+            m_charmapLookups++;
 
-            if (sequence.length() == 0)
+            if (sequence.length == 0)
             {
-                m_buffer[m_pos] = 0;
-                RaiseError("unknown constant '%s'", &m_buffer[startPos]);
+                std::string name(&m_buffer[startPos], m_pos - startPos);
+                RaiseError("unknown constant '%s'", name.c_str());
             }
 
-            totalSequence += sequence;
+            AppendBytes(sequence.data, sequence.length);
         }
         else if (IsAsciiDigit(m_buffer[m_pos]))
         {
-            Integer integer = ReadInteger();
-
-            switch (integer.size)
-            {
-            case 1:
-                totalSequence += (unsigned char)integer.value;
-                break;
-            case 2:
-                totalSequence += (unsigned char)integer.value;
-                totalSequence += (unsigned char)(integer.value >> 8);
-                break;
-            case 4:
-                totalSequence += (unsigned char)integer.value;
-                totalSequence += (unsigned char)(integer.value >> 8);
-                totalSequence += (unsigned char)(integer.value >> 16);
-                totalSequence += (unsigned char)(integer.value >> 24);
-                break;
-            }
+            AppendInteger(ReadInteger());
         }
         else if (m_buffer[m_pos] == 0)
         {
@@ -161,13 +174,13 @@ std::string StringParser::ReadBracketedConstants()
     }
 
     m_pos++; // Go past the right curly bracket.
-
-    return totalSequence;
 }
 
 // Reads a charmap string.
 int StringParser::ParseString(long srcPos, unsigned char* dest, int& destLength)
 {
+    PhaseScope phase(Stats::kEncode);
+
     m_pos = srcPos;
 
     if (m_buffer[m_pos] != '"')
@@ -177,23 +190,24 @@ int StringParser::ParseString(long srcPos, unsigned char* dest, int& destLength)
 
     m_pos++;
 
-    destLength = 0;
+    m_dest = dest;
+    m_destLength = 0;
 
     while (m_buffer[m_pos] != '"')
     {
-        std::string sequence = (m_buffer[m_pos] == '{') ? ReadBracketedConstants() : ReadCharOrEscape();
-
-        for (const char& c : sequence)
-        {
-            if (destLength == kMaxStringLength)
-                RaiseError("mapped string longer than %d bytes", kMaxStringLength);
-
-            dest[destLength++] = c;
-        }
+        if (m_buffer[m_pos] == '{')
+            ReadBracketedConstants();
+        else
+            ReadCharOrEscape();
     }
 
     m_pos++; // Go past the right quote.
 
+    destLength = m_destLength;
+
+    if (g_stats)
+        g_stats->AddStringEncoded(m_charmapLookups);
+
     return m_pos - start;
 }
 
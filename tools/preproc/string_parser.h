@@ -21,6 +21,7 @@
 #ifndef STRING_PARSER_H
 #define STRING_PARSER_H
 
+#include <cstddef>
 #include <cstdint>
 #include <string>
 #include "preproc.h"
@@ -28,7 +29,7 @@
 class StringParser
 {
 public:
-    StringParser(char* buffer, long size) : m_buffer(buffer), m_size(size), m_pos(0) {}
+    StringParser(const char* buffer, long size) : m_buffer(buffer), m_size(size), m_pos(0), m_charmapLookups(0) {}
     int ParseString(long srcPos, unsigned char* dest, int &destLength);
 
 private:
@@ -38,15 +39,20 @@ private:
         int size;
     };
 
-    char* m_buffer;
+    const char* m_buffer;
     long m_size;
     long m_pos;
+    unsigned char* m_dest;
+    int m_destLength;
+    long m_charmapLookups;
 
     Integer ReadInteger();
     Integer ReadDecimal();
     Integer ReadHex();
-    std::string ReadCharOrEscape();
-    std::string ReadBracketedConstants();
+    void AppendBytes(const unsigned char* bytes, std::size_t length);
+    void AppendInteger(Integer integer);
+    void ReadCharOrEscape();
+    void ReadBracketedConstants();
     void SkipWhitespace();
     void SkipRestOfInteger(int radix);
     void RaiseError(const char* format, ...);
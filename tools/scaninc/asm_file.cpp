@@ -23,42 +23,15 @@
 #include "scaninc.h"
 #include "asm_file.h"
 
-AsmFile::AsmFile(std::string path)
+AsmFile::AsmFile(std::string path, const std::string& contents)
 {
     m_path = path;
-
-    FILE *fp = std::fopen(path.c_str(), "rb");
-
-    if (fp == NULL)
-        FATAL_ERROR("Failed to open \"%s\" for reading.\n", path.c_str());
-
-    std::fseek(fp, 0, SEEK_END);
-
-    m_size = std::ftell(fp);
-
-    if (m_size < 0)
-        FATAL_ERROR("File size of \"%s\" is less than zero.\n", path.c_str());
-    else if (m_size == 0)
-        return; // Empty file
-
-    m_buffer = new char[m_size];
-
-    std::rewind(fp);
-
-    if (std::fread(m_buffer, m_size, 1, fp) != 1)
-        FATAL_ERROR("Failed to read \"%s\".\n", path.c_str());
-
-    std::fclose(fp);
-
+    m_buffer = contents.data();
+    m_size = contents.size();
     m_pos = 0;
     m_lineNum = 1;
 }
 
-AsmFile::~AsmFile()
-{
-    if (m_size > 0) delete[] m_buffer;
-}
-
 IncDirectiveType AsmFile::ReadUntilIncDirective(std::string &path)
 {
     // At the beginning of each loop iteration, the current file position
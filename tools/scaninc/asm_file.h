@@ -34,12 +34,12 @@ enum class IncDirectiveType
 class AsmFile
 {
 public:
-    AsmFile(std::string path);
-    ~AsmFile();
+    // Parses "contents", which has to outlive the AsmFile; "path" is for messages.
+    AsmFile(std::string path, const std::string& contents);
     IncDirectiveType ReadUntilIncDirective(std::string& path);
 
 private:
-    char *m_buffer;
+    const char *m_buffer;
     int m_pos;
     int m_size;
     int m_lineNum;
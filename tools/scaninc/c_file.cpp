@@ -20,38 +20,18 @@
 
 #include "c_file.h"
 
-CFile::CFile(std::string path)
+CFile::CFile(std::string path, const std::string& contents)
 {
     m_path = path;
 
-    FILE *fp = std::fopen(path.c_str(), "rb");
-
-    if (fp == NULL)
-        FATAL_ERROR("Failed to open \"%s\" for reading.\n", path.c_str());
-
-    std::fseek(fp, 0, SEEK_END);
-
-    m_size = std::ftell(fp);
-
-    m_buffer = new char[m_size + 1];
-    m_buffer[m_size] = 0;
-
-    std::rewind(fp);
-
-    if (std::fread(m_buffer, m_size, 1, fp) != 1)
-        FATAL_ERROR("Failed to read \"%s\".\n", path.c_str());
-
-    std::fclose(fp);
+    // c_str() is null-terminated, which the scanning relies on.
+    m_buffer = contents.c_str();
+    m_size = contents.size();
 
     m_pos = 0;
     m_lineNum = 1;
 }
 
-CFile::~CFile()
-{
-    delete[] m_buffer;
-}
-
 void CFile::FindIncbins()
 {
     char stringChar = 0;
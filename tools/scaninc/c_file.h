@@ -29,14 +29,14 @@
 class CFile
 {
 public:
-    CFile(std::string path);
-    ~CFile();
+    // Parses "contents", which has to outlive the CFile; "path" is for messages.
+    CFile(std::string path, const std::string& contents);
     void FindIncbins();
     const std::set<std::string>& GetIncbins() { return m_incbins; }
     const std::set<std::string>& GetIncludes() { return m_includes; }
 
 private:
-    char *m_buffer;
+    const char *m_buffer;
     int m_pos;
     int m_size;
     int m_lineNum;
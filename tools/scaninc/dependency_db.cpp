@@ -0,0 +1,255 @@
+// Copyright(c) 2015-2017 YamaArashi
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <sys/stat.h>
+#include "scaninc.h"
+#include "source_file.h"
+#include "dependency_db.h"
+
+// Bump this whenever the scanners start finding something different,
+// so that old results get thrown away.
+static const int kDbVersion = 1;
+
+static std::uint64_t HashContents(const std::string& contents)
+{
+    // 64-bit FNV-1a
+    std::uint64_t hash = 0xCBF29CE484222325ULL;
+
+    for (unsigned char c : contents)
+    {
+        hash ^= c;
+        hash *= 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+static bool ReadWholeFile(const std::string& path, std::string& contents)
+{
+    std::ifstream file(path, std::ios::binary);
+
+    if (!file)
+        return false;
+
+    contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return !file.bad();
+}
+
+DependencyDb::DependencyDb()
+{
+    m_lastScanTime = 0;
+    m_scanTime = std::time(nullptr);
+    m_dirty = false;
+}
+
+void DependencyDb::Load(const std::string& path)
+{
+    std::ifstream file(path, std::ios::binary);
+
+    if (!file)
+        return;
+
+    std::string line;
+    int version;
+    long long scanTime;
+
+    if (!std::getline(file, line)
+        || std::sscanf(line.c_str(), "scaninc-db %d %lld", &version, &scanTime) != 2
+        || version != kDbVersion)
+    {
+        m_dirty = true;
+        return;
+    }
+
+    ScannedFile *current = nullptr;
+
+    while (std::getline(file, line))
+    {
+        if (line.size() < 2 || line[1] != ' ')
+            break;
+
+        std::string rest = line.substr(2);
+
+        if (line[0] == 'F')
+        {
+            long long mtime, size;
+            unsigned long long hash;
+            int pathStart = -1;
+
+            std::sscanf(rest.c_str(), "%lld %lld %llx %n", &mtime, &size, &hash, &pathStart);
+
+            if (pathStart < 0)
+                break;
+
+            current = &m_files[rest.substr(pathStart)];
+            current->mtime = mtime;
+            current->size = size;
+            current->hash = hash;
+        }
+        else if (line[0] == 'I' && current != nullptr)
+        {
+            current->includes.insert(rest);
+        }
+        else if (line[0] == 'B' && current != nullptr)
+        {
+            current->incbins.insert(rest);
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if (!file.eof())
+    {
+        // Something is wrong with the database, so rescan everything.
+        m_files.clear();
+        m_dirty = true;
+        return;
+    }
+
+    m_lastScanTime = scanTime;
+}
+
+std::string DependencyDb::Serialize()
+{
+    std::string out = "scaninc-db " + std::to_string(kDbVersion) + " " + std::to_string(m_scanTime) + "\n";
+    char buffer[64];
+
+    // Files that weren't needed this time are dropped.
+    for (const std::string& path : m_usedFiles)
+    {
+        const ScannedFile& file = m_files[path];
+
+        std::snprintf(buffer, sizeof(buffer), "F %lld %lld %016llx ",
+            (long long)file.mtime, (long long)file.size, (unsigned long long)file.hash);
+        out += buffer;
+        out += path;
+        out += '\n';
+
+        for (const std::string& include : file.includes)
+            out += "I " + include + "\n";
+
+        for (const std::string& incbin : file.incbins)
+            out += "B " + incbin + "\n";
+    }
+
+    return out;
+}
+
+bool DependencyDb::IsDirty()
+{
+    return m_dirty || m_usedFiles.size() != m_files.size();
+}
+
+// Several threads may scan at once, as long as they scan different files.
+const ScannedFile& DependencyDb::Scan(const std::string& path)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    auto it = m_files.find(path);
+    bool known = (it != m_files.end());
+
+    // Already looked at during this run.
+    if (known && m_usedFiles.count(path) != 0)
+        return it->second;
+
+    m_usedFiles.insert(path);
+
+    ScannedFile& scanned = known ? it->second : m_files[path];
+
+    lock.unlock();
+
+    struct stat st;
+
+    if (stat(path.c_str(), &st) != 0)
+        FATAL_ERROR("Failed to open \"%s\" for reading.\n", path.c_str());
+
+    // A file modified in the same second as the last scan could have changed
+    // again after it was read without its mtime changing, so check its contents.
+    if (known
+        && scanned.mtime == (std::int64_t)st.st_mtime
+        && scanned.size == (std::int64_t)st.st_size
+        && scanned.mtime < m_lastScanTime)
+    {
+        return scanned;
+    }
+
+    std::string contents;
+
+    if (!ReadWholeFile(path, contents))
+        FATAL_ERROR("Failed to read \"%s\".\n", path.c_str());
+
+    std::uint64_t hash = HashContents(contents);
+
+    m_dirty = true;
+
+    if (known && scanned.hash == hash && scanned.size == (std::int64_t)contents.size())
+    {
+        scanned.mtime = st.st_mtime;
+        return scanned;
+    }
+
+    SourceFile file(path, contents);
+
+    scanned.mtime = st.st_mtime;
+    scanned.size = contents.size();
+    scanned.hash = hash;
+    scanned.includes = file.GetIncludes();
+    scanned.incbins = file.GetIncbins();
+
+    return scanned;
+}
+
+bool WriteFileIfChanged(const std::string& path, const std::string& contents)
+{
+    std::string oldContents;
+
+    if (ReadWholeFile(path, oldContents) && oldContents == contents)
+        return true;
+
+    std::string tempPath = path + ".tmp";
+    FILE *fp = std::fopen(tempPath.c_str(), "wb");
+
+    if (fp == NULL)
+        return false;
+
+    bool ok = (contents.empty() || std::fwrite(contents.data(), contents.size(), 1, fp) == 1);
+
+    if (std::fclose(fp) != 0)
+        ok = false;
+
+#ifdef _WIN32
+    // Windows won't rename over an existing file.
+    std::remove(path.c_str());
+#endif
+
+    if (!ok || std::rename(tempPath.c_str(), path.c_str()) != 0)
+    {
+        std::remove(tempPath.c_str());
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,65 @@
+// Copyright(c) 2015-2017 YamaArashi
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef DEPENDENCY_DB_H
+#define DEPENDENCY_DB_H
+
+#include <cstdint>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+
+// The includes and incbins of one source file, along with what the file
+// looked like when it was scanned.
+struct ScannedFile
+{
+    std::int64_t mtime;
+    std::int64_t size;
+    std::uint64_t hash;
+    std::set<std::string> includes;
+    std::set<std::string> incbins;
+};
+
+// Scan results that are kept between runs, so that a file is only read
+// again if its mtime or size changed and only parsed again if its contents
+// did.
+class DependencyDb
+{
+public:
+    DependencyDb();
+    void Load(const std::string& path);
+    std::string Serialize();
+    bool IsDirty();
+    const ScannedFile& Scan(const std::string& path);
+
+private:
+    std::map<std::string, ScannedFile> m_files;
+    std::set<std::string> m_usedFiles;
+    std::int64_t m_lastScanTime;
+    std::int64_t m_scanTime;
+    std::atomic<bool> m_dirty;
+    std::mutex m_mutex;
+};
+
+bool WriteFileIfChanged(const std::string& path, const std::string& contents);
+
+#endif // DEPENDENCY_DB_H
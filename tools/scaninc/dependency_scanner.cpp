@@ -0,0 +1,178 @@
+// Copyright(c) 2015-2017 YamaArashi
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include <condition_variable>
+#include <queue>
+#include <thread>
+#include <unordered_set>
+#include "scaninc.h"
+#include "source_file.h"
+#include "dependency_scanner.h"
+
+DependencyScanner::DependencyScanner(DependencyDb& db, const std::vector<std::string>& includeDirs)
+    : m_db(db), m_includeDirs(includeDirs)
+{
+}
+
+// Finds where an include of a file in srcDir is, searching the include paths
+// before srcDir. If it isn't anywhere, the path in srcDir is returned.
+// Called with m_mutex held.
+const std::pair<std::string, bool>& DependencyScanner::FindInclude(const std::string& srcDir, const std::string& include)
+{
+    std::string key = srcDir + '\n' + include;
+    auto it = m_foundIncludes.find(key);
+
+    if (it != m_foundIncludes.end())
+        return it->second;
+
+    std::pair<std::string, bool>& found = m_foundIncludes[key];
+
+    for (const std::string& includeDir : m_includeDirs)
+    {
+        found.first = includeDir + include;
+        if (m_directoryCache.FileExists(found.first))
+        {
+            found.second = true;
+            return found;
+        }
+    }
+
+    found.first = srcDir + include;
+    found.second = m_directoryCache.FileExists(found.first);
+    return found;
+}
+
+// Several threads may resolve at once, as long as they resolve different files.
+const ResolvedFile& DependencyScanner::Resolve(const std::string& filePath)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_resolvedFiles.find(filePath);
+
+        if (it != m_resolvedFiles.end())
+            return it->second;
+    }
+
+    std::string pathCopy(filePath);
+    SourceFileType fileType = GetFileType(pathCopy);
+    std::string srcDir = GetDir(pathCopy);
+    const ScannedFile& scanned = m_db.Scan(filePath);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    ResolvedFile& file = m_resolvedFiles[filePath];
+
+    file.scanned = &scanned;
+
+    for (auto include : file.scanned->includes)
+    {
+        const std::pair<std::string, bool>& found = FindInclude(srcDir, include);
+        if (!found.second && (fileType == SourceFileType::Asm || fileType == SourceFileType::Inc))
+        {
+            file.includes.emplace_back(include, false);
+        }
+        else
+        {
+            file.includes.push_back(found);
+        }
+    }
+
+    return file;
+}
+
+// Scans and resolves every file reachable from initialPaths ahead of time.
+// Workers take files off a shared frontier and add the includes they find
+// that nobody has taken yet, until there is nothing left and nobody is busy.
+void DependencyScanner::ScanAll(const std::set<std::string>& initialPaths, unsigned threadCount)
+{
+    std::mutex mutex;
+    std::condition_variable frontierChanged;
+    std::vector<std::string> frontier(initialPaths.begin(), initialPaths.end());
+    std::unordered_set<std::string> visited(initialPaths.begin(), initialPaths.end());
+    unsigned busyCount = 0;
+
+    auto worker = [&]()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        for (;;)
+        {
+            frontierChanged.wait(lock, [&]() { return !frontier.empty() || busyCount == 0; });
+
+            if (frontier.empty())
+                break;
+
+            std::string path = std::move(frontier.back());
+            frontier.pop_back();
+            busyCount++;
+
+            lock.unlock();
+            const ResolvedFile& file = Resolve(path);
+            lock.lock();
+
+            busyCount--;
+            for (const auto& include : file.includes)
+            {
+                if (include.second && visited.insert(include.first).second)
+                    frontier.push_back(include.first);
+            }
+            frontierChanged.notify_all();
+        }
+    };
+
+    std::vector<std::thread> threads;
+
+    for (unsigned i = 1; i < threadCount; i++)
+        threads.emplace_back(worker);
+
+    worker();
+
+    for (std::thread& thread : threads)
+        thread.join();
+}
+
+// Finds every file that the file at initialPath depends on, directly or through includes.
+std::set<std::string> DependencyScanner::ScanDependencies(const std::string& initialPath)
+{
+    std::queue<std::string> filesToProcess;
+    std::set<std::string> dependencies;
+
+    filesToProcess.push(initialPath);
+
+    while (!filesToProcess.empty())
+    {
+        const ResolvedFile& file = Resolve(filesToProcess.front());
+        filesToProcess.pop();
+
+        for (auto incbin : file.scanned->incbins)
+        {
+            dependencies.insert(incbin);
+        }
+        for (auto include : file.includes)
+        {
+            bool inserted = dependencies.insert(include.first).second;
+            if (inserted && include.second)
+            {
+                filesToProcess.push(include.first);
+            }
+        }
+    }
+
+    return dependencies;
+}
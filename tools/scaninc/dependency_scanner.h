@@ -0,0 +1,66 @@
+// Copyright(c) 2015-2017 YamaArashi
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef DEPENDENCY_SCANNER_H
+#define DEPENDENCY_SCANNER_H
+
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "dependency_db.h"
+#include "directory_cache.h"
+
+// A scanned file with its includes resolved against the include paths.
+// The second member of each include is whether it was found, in which
+// case it has to be scanned too.
+struct ResolvedFile
+{
+    const ScannedFile *scanned;
+    std::vector<std::pair<std::string, bool>> includes;
+};
+
+// Walks the includes of any number of files. Since where an include is
+// found only depends on the include paths and the directory of the file
+// including it, each file is resolved once and reused for every root, and
+// each include is looked up once per directory that includes it.
+class DependencyScanner
+{
+public:
+    DependencyScanner(DependencyDb& db, const std::vector<std::string>& includeDirs);
+    void ScanAll(const std::set<std::string>& initialPaths, unsigned threadCount);
+    std::set<std::string> ScanDependencies(const std::string& initialPath);
+
+private:
+    DependencyDb& m_db;
+    std::vector<std::string> m_includeDirs;
+    std::map<std::string, ResolvedFile> m_resolvedFiles;
+    std::unordered_map<std::string, std::pair<std::string, bool>> m_foundIncludes;
+    DirectoryCache m_directoryCache;
+    std::mutex m_mutex;
+
+    const std::pair<std::string, bool>& FindInclude(const std::string& srcDir, const std::string& include);
+    const ResolvedFile& Resolve(const std::string& path);
+};
+
+#endif // DEPENDENCY_SCANNER_H
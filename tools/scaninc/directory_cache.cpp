@@ -0,0 +1,94 @@
+// Copyright(c) 2015-2017 YamaArashi
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include <algorithm>
+#include <cctype>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#endif
+#include "directory_cache.h"
+
+// Where the filesystem usually ignores case, so does the lookup,
+// because that's what opening the file would have done.
+#if defined(_WIN32) || defined(__APPLE__)
+static std::string NormalizeName(std::string name)
+{
+    std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::tolower(c); });
+    return name;
+}
+#else
+static const std::string& NormalizeName(const std::string& name)
+{
+    return name;
+}
+#endif
+
+const std::unordered_set<std::string>& DirectoryCache::GetEntries(const std::string& dir)
+{
+    auto it = m_directories.find(dir);
+
+    if (it != m_directories.end())
+        return it->second;
+
+    // A directory that can't be listed is treated as empty.
+    std::unordered_set<std::string>& entries = m_directories[dir];
+    std::string dirPath = dir.empty() ? std::string(".") : dir;
+
+#ifdef _WIN32
+    WIN32_FIND_DATAA findData;
+    HANDLE handle = FindFirstFileA((dirPath + "/*").c_str(), &findData);
+
+    if (handle != INVALID_HANDLE_VALUE)
+    {
+        do
+        {
+            entries.insert(NormalizeName(findData.cFileName));
+        } while (FindNextFileA(handle, &findData));
+
+        FindClose(handle);
+    }
+#else
+    DIR *dirHandle = opendir(dirPath.c_str());
+
+    if (dirHandle != NULL)
+    {
+        struct dirent *entry;
+
+        while ((entry = readdir(dirHandle)) != NULL)
+            entries.insert(NormalizeName(entry->d_name));
+
+        closedir(dirHandle);
+    }
+#endif
+
+    return entries;
+}
+
+bool DirectoryCache::FileExists(const std::string& path)
+{
+    std::size_t slash = path.rfind('/');
+
+    if (slash == std::string::npos)
+        return GetEntries("").count(NormalizeName(path)) != 0;
+
+    return GetEntries(path.substr(0, slash + 1)).count(NormalizeName(path.substr(slash + 1))) != 0;
+}
@@ -20,37 +20,89 @@
 
 #include <cstdio>
 #include <cstdlib>
-#include <list>
-#include <queue>
+#include <fstream>
 #include <set>
 #include <string>
+#include <thread>
+#include <vector>
 #include "scaninc.h"
-#include "source_file.h"
+#include "dependency_db.h"
+#include "dependency_scanner.h"
 
-bool CanOpenFile(std::string path)
+const char *const USAGE = "Usage: scaninc [-I INCLUDE_PATH] [--db DB_PATH] FILE_PATH\n"
+                          "       scaninc [-I INCLUDE_PATH] [--db DB_PATH] [-o MAKEFILE_PATH] [-t TARGET_PATTERN] [-j JOBS] FILE_PATH|@LIST_PATH...\n";
+
+// Reads the paths listed in a file, one per line.
+void ReadPathList(const std::string& listPath, std::set<std::string>& paths)
 {
-    FILE *fp = std::fopen(path.c_str(), "rb");
+    std::ifstream file(listPath);
+
+    if (!file)
+        FATAL_ERROR("Failed to open \"%s\" for reading.\n", listPath.c_str());
+
+    std::string line;
 
-    if (fp == NULL)
-        return false;
+    while (std::getline(file, line))
+    {
+        std::size_t end = line.find_last_not_of(" \t\r");
 
-    std::fclose(fp);
-    return true;
+        if (end != std::string::npos)
+            paths.insert(line.substr(0, end + 1));
+    }
 }
 
-const char *const USAGE = "Usage: scaninc [-I INCLUDE_PATH] FILE_PATH\n";
+// Lists the dependencies of every file. Without a target pattern, that's one
+// variable per file for the makefile to look up. Otherwise, it's a rule for each
+// target, made by replacing '%' in the pattern with the file's path minus its extension.
+std::string MakeDependencyMakefile(DependencyScanner& scanner, const std::set<std::string>& initialPaths, const std::string& targetPattern)
+{
+    std::string makefile = "# Generated by scaninc. Do not edit.\n";
+
+    for (const std::string &initialPath : initialPaths)
+    {
+        if (targetPattern.empty())
+        {
+            makefile += "SCANINC_DEPS_" + initialPath + " :=";
+        }
+        else
+        {
+            std::string target = targetPattern;
+            std::size_t percent = target.find('%');
+            std::size_t slash = initialPath.find_last_of('/');
+            std::size_t dot = initialPath.find_last_of('.');
+
+            // A '.' in a directory name isn't an extension.
+            if (slash != std::string::npos && dot != std::string::npos && dot < slash)
+                dot = std::string::npos;
+
+            if (percent != std::string::npos)
+                target.replace(percent, 1, initialPath.substr(0, dot));
+
+            makefile += target + ":";
+        }
+        for (const std::string &path : scanner.ScanDependencies(initialPath))
+        {
+            makefile += " " + path;
+        }
+        makefile += "\n";
+    }
+
+    return makefile;
+}
 
 int main(int argc, char **argv)
 {
-    std::queue<std::string> filesToProcess;
-    std::set<std::string> dependencies;
-
     std::vector<std::string> includeDirs;
+    std::set<std::string> initialPaths;
+    std::string dbPath;
+    std::string makefilePath;
+    std::string targetPattern;
+    unsigned threadCount = std::thread::hardware_concurrency();
 
     argc--;
     argv++;
 
-    while (argc > 1)
+    while (argc > 0)
     {
         std::string arg(argv[0]);
         if (arg.substr(0, 2) == "-I")
@@ -58,6 +110,8 @@ int main(int argc, char **argv)
             std::string includeDir = arg.substr(2);
             if (includeDir.empty())
             {
+                if (argc < 2)
+                    FATAL_ERROR(USAGE);
                 argc--;
                 argv++;
                 includeDir = std::string(argv[0]);
@@ -68,61 +122,74 @@ int main(int argc, char **argv)
             }
             includeDirs.push_back(includeDir);
         }
-        else
+        else if (arg == "--db" || arg == "-o" || arg == "-t")
+        {
+            if (argc < 2)
+                FATAL_ERROR(USAGE);
+            argc--;
+            argv++;
+            (arg == "--db" ? dbPath : arg == "-o" ? makefilePath : targetPattern) = std::string(argv[0]);
+        }
+        else if (arg == "-j")
+        {
+            if (argc < 2)
+                FATAL_ERROR(USAGE);
+            argc--;
+            argv++;
+            threadCount = std::strtoul(argv[0], nullptr, 10);
+        }
+        else if (!arg.empty() && arg[0] == '@')
+        {
+            ReadPathList(arg.substr(1), initialPaths);
+        }
+        else if (!arg.empty() && arg[0] == '-')
         {
             FATAL_ERROR(USAGE);
         }
+        else
+        {
+            initialPaths.insert(arg);
+        }
         argc--;
         argv++;
     }
 
-    if (argc != 1) {
+    if (initialPaths.empty() && makefilePath.empty())
+    {
         FATAL_ERROR(USAGE);
     }
 
-    std::string initialPath(argv[0]);
+    DependencyDb db;
 
-    filesToProcess.push(initialPath);
+    if (!dbPath.empty())
+        db.Load(dbPath);
 
-    while (!filesToProcess.empty())
+    DependencyScanner scanner(db, includeDirs);
+
+    scanner.ScanAll(initialPaths, threadCount == 0 ? 1 : threadCount);
+
+    if (initialPaths.size() == 1 && makefilePath.empty() && targetPattern.empty())
     {
-        std::string filePath = filesToProcess.front();
-        SourceFile file(filePath);
-        filesToProcess.pop();
+        for (const std::string &path : scanner.ScanDependencies(*initialPaths.begin()))
+        {
+            std::printf("%s\n", path.c_str());
+        }
+    }
+    else
+    {
+        std::string makefile = MakeDependencyMakefile(scanner, initialPaths, targetPattern);
 
-        includeDirs.push_back(file.GetSrcDir());
-        for (auto incbin : file.GetIncbins())
+        if (makefilePath.empty() || makefilePath == "-")
         {
-            dependencies.insert(incbin);
+            std::fputs(makefile.c_str(), stdout);
         }
-        for (auto include : file.GetIncludes())
+        // Writing the file only when it changed keeps make from restarting.
+        else if (!WriteFileIfChanged(makefilePath, makefile))
         {
-            bool exists = false;
-            std::string path("");
-            for (auto includeDir : includeDirs)
-            {
-                path = includeDir + include;
-                if (CanOpenFile(path))
-                {
-                    exists = true;
-                    break;
-                }
-            }
-            if (!exists && (file.FileType() == SourceFileType::Asm || file.FileType() == SourceFileType::Inc))
-            {
-                path = include;
-            }
-            bool inserted = dependencies.insert(path).second;
-            if (inserted && exists)
-            {
-                filesToProcess.push(path);
-            }
+            FATAL_ERROR("Failed to write \"%s\".\n", makefilePath.c_str());
         }
-        includeDirs.pop_back();
     }
 
-    for (const std::string &path : dependencies)
-    {
-        std::printf("%s\n", path.c_str());
-    }
+    if (!dbPath.empty() && db.IsDirty() && !WriteFileIfChanged(dbPath, db.Serialize()))
+        FATAL_ERROR("Failed to write \"%s\".\n", dbPath.c_str());
 }
@@ -24,9 +24,10 @@
 
 SourceFileType GetFileType(std::string& path)
 {
+    std::size_t slash = path.find_last_of('/');
     std::size_t pos = path.find_last_of('.');
 
-    if (pos == std::string::npos)
+    if (pos == std::string::npos || (slash != std::string::npos && pos < slash))
         FATAL_ERROR("no file extension in path \"%s\"\n", path.c_str());
 
     std::string extension = path.substr(pos + 1);
@@ -56,7 +57,7 @@ std::string GetDir(std::string& path)
         return std::string("");
 }
 
-SourceFile::SourceFile(std::string path)
+SourceFile::SourceFile(std::string path, const std::string& contents)
 {
     m_file_type = GetFileType(path);
 
@@ -65,12 +66,12 @@ SourceFile::SourceFile(std::string path)
     if (m_file_type == SourceFileType::Cpp
             || m_file_type == SourceFileType::Header)
     {
-        new (&m_source_file.c_file) CFile(path);
+        new (&m_source_file.c_file) CFile(path, contents);
         m_source_file.c_file.FindIncbins();
     }
     else
     {
-        AsmFile file(path);
+        AsmFile file(path, contents);
         std::set<std::string> incbins;
         std::set<std::string> includes;
 
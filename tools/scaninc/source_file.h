@@ -35,12 +35,14 @@ enum class SourceFileType
 };
 
 SourceFileType GetFileType(std::string& path);
+std::string GetDir(std::string& path);
 
 class SourceFile
 {
 public:
 
-    SourceFile(std::string path);
+    // Parses "contents", the contents of the file at "path".
+    SourceFile(std::string path, const std::string& contents);
     ~SourceFile();
     SourceFile(SourceFile const&) = delete;
     SourceFile(SourceFile&&) = delete;